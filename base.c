@@ -98,6 +98,11 @@ mem_decommit_release(Mem_Base *mb, void *p, usize size) {
   mem_release(mb, p, size);
 }
 
+function bool
+mem_grow(Mem_Base *mb, void *p, usize size, usize new_size) {
+  return mb->grow != NULL && mb->grow(mb->ctx, p, size, new_size);
+}
+
 function void
 mem_noop_mem_change(void *ctx_, void *p_, usize size_) {
   (void)ctx_; (void)p_; (void)size_;
@@ -127,6 +132,415 @@ mem_malloc_base(void) {
   return &base;
 }
 
+// What this thread has counted but not yet added to mem_tag_totals.
+typedef struct {
+  s64 reserved;
+  s64 committed;
+  u64 reservations;
+  u64 releases;
+} Mem_TagDelta;
+
+global Mem_TagStats mem_tag_totals[Mem_Tag_COUNT]; // atomic
+global _Thread_local Mem_TagDelta mem_tag_deltas[Mem_Tag_COUNT];
+
+function void
+mem_tag_flush(Mem_Tag tag) {
+  Mem_TagDelta *d = &mem_tag_deltas[tag];
+  Mem_TagStats *t = &mem_tag_totals[tag];
+  // Adding a negative delta as u64 wraps around to the right total.
+  __atomic_add_fetch(&t->reserved, (u64)d->reserved, __ATOMIC_RELAXED);
+  u64 committed = __atomic_add_fetch(&t->committed, (u64)d->committed, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&t->reservations, d->reservations, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&t->releases, d->releases, __ATOMIC_RELAXED);
+  u64 peak = __atomic_load_n(&t->peak_committed, __ATOMIC_RELAXED);
+  while (committed > peak && !__atomic_compare_exchange_n(&t->peak_committed, &peak, committed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+  *d = (Mem_TagDelta){0};
+}
+
+function void
+mem_tag_count(Mem_Tag tag, s64 reserved, s64 committed, u64 reservations, u64 releases) {
+  if (tag == Mem_Tag_None) return;
+  Mem_TagDelta *d = &mem_tag_deltas[tag];
+  d->reserved     += reserved;
+  d->committed    += committed;
+  d->reservations += reservations;
+  d->releases     += releases;
+  if (d->reserved >= MEM_TAG_FLUSH_BYTES || d->reserved <= -MEM_TAG_FLUSH_BYTES ||
+      d->committed >= MEM_TAG_FLUSH_BYTES || d->committed <= -MEM_TAG_FLUSH_BYTES ||
+      d->reservations + d->releases >= MEM_TAG_FLUSH_COUNT)
+    mem_tag_flush(tag);
+}
+
+function Mem_TagStats
+mem_tag_stats(Mem_Tag tag) {
+  Mem_TagStats *t = &mem_tag_totals[tag];
+  return (Mem_TagStats){
+    .reserved       = __atomic_load_n(&t->reserved, __ATOMIC_RELAXED),
+    .committed      = __atomic_load_n(&t->committed, __ATOMIC_RELAXED),
+    .peak_committed = __atomic_load_n(&t->peak_committed, __ATOMIC_RELAXED),
+    .reservations   = __atomic_load_n(&t->reservations, __ATOMIC_RELAXED),
+    .releases       = __atomic_load_n(&t->releases, __ATOMIC_RELAXED),
+  };
+}
+
+function const char *
+mem_tag_name(Mem_Tag tag) {
+  local const char *names[] = {
+    [Mem_Tag_None] = "none",
+#define X(name, label) [Glue(Mem_Tag_, name)] = label,
+    XM_MEM_TAGS
+#undef X
+  };
+  return tag < Mem_Tag_COUNT ? names[tag] : "invalid";
+}
+
+function void *
+mem_accounting_reserve(void *ctx, usize size) {
+  Mem_Accounting *a = ctx;
+  void *p = mem_reserve(a->backing, size);
+  if (p != NULL) mem_tag_count(a->tag, (s64)size, 0, 1, 0);
+  return p;
+}
+
+function void
+mem_accounting_commit(void *ctx, void *p, usize size) {
+  Mem_Accounting *a = ctx;
+  mem_commit(a->backing, p, size);
+  if (p != NULL) mem_tag_count(a->tag, 0, (s64)size, 0, 0);
+}
+
+function void
+mem_accounting_decommit(void *ctx, void *p, usize size) {
+  Mem_Accounting *a = ctx;
+  mem_decommit(a->backing, p, size);
+  if (p != NULL) mem_tag_count(a->tag, 0, -(s64)size, 0, 0);
+}
+
+function void
+mem_accounting_release(void *ctx, void *p, usize size) {
+  Mem_Accounting *a = ctx;
+  mem_release(a->backing, p, size);
+  if (p != NULL) mem_tag_count(a->tag, -(s64)size, 0, 0, 1);
+}
+
+// Grown blocks come committed.
+function bool
+mem_accounting_grow(void *ctx, void *p, usize size, usize new_size) {
+  Mem_Accounting *a = ctx;
+  if (!mem_grow(a->backing, p, size, new_size)) return false;
+  mem_tag_count(a->tag, (s64)(new_size - size), (s64)(new_size - size), 0, 0);
+  return true;
+}
+
+function void
+mem_accounting_init(Mem_Accounting *a, Mem_Base *backing, Mem_Tag tag) {
+  *a = (Mem_Accounting){ .backing = backing, .tag = tag };
+  a->base = (Mem_Base){
+    .reserve  = mem_accounting_reserve,
+    .commit   = mem_accounting_commit,
+    .decommit = mem_accounting_decommit,
+    .release  = mem_accounting_release,
+    .grow     = backing->grow != NULL ? mem_accounting_grow : NULL,
+    .ctx      = a,
+  };
+}
+
+#if OsHasFlags(OS_FLAGS_POSIX)
+function bool
+mem_arena_commit_to(Mem_Arena *a, usize end) {
+  usize to = (end + MEM_ARENA_COMMIT_GRANULARITY - 1) & ~(usize)(MEM_ARENA_COMMIT_GRANULARITY - 1);
+  if (mprotect(a->mem + a->committed, to - a->committed, PROT_READ | PROT_WRITE) != 0) return false;
+  mem_tag_count(a->tag, 0, (s64)(to - a->committed), 0, 0);
+  a->committed = to;
+  return true;
+}
+
+function void
+mem_arena_decommit_from(Mem_Arena *a, usize from) {
+  // MADV_DONTNEED hands the pages back right away, PROT_NONE makes stray accesses fault.
+  madvise(a->mem + from, a->committed - from, MADV_DONTNEED);
+  mprotect(a->mem + from, a->committed - from, PROT_NONE);
+  mem_tag_count(a->tag, 0, -(s64)(a->committed - from), 0, 0);
+  a->committed = from;
+}
+#else
+# error "No Mem_Arena support for this OS"
+#endif
+
+function void *
+mem_arena_push(Mem_Arena *a, usize size) {
+  usize start = (a->pos + MEM_ARENA_ALIGN - 1) & ~(usize)(MEM_ARENA_ALIGN - 1);
+  if (size > a->reserved - start) return NULL;
+  usize end = start + size;
+  if (end > a->committed && !mem_arena_commit_to(a, end)) return NULL;
+  a->pos = end;
+  return a->mem + start;
+}
+
+function usize
+mem_arena_pos(Mem_Arena *a) {
+  return a->pos;
+}
+
+function void
+mem_arena_pop_to(Mem_Arena *a, usize pos) {
+  Assert(pos <= a->pos);
+  a->pos = pos;
+  usize keep = ((pos + MEM_ARENA_COMMIT_GRANULARITY - 1) & ~(usize)(MEM_ARENA_COMMIT_GRANULARITY - 1)) + MEM_ARENA_KEEP_COMMITTED;
+  if (a->committed > keep) mem_arena_decommit_from(a, keep);
+}
+
+function void
+mem_arena_clear(Mem_Arena *a) {
+  mem_arena_pop_to(a, 0);
+}
+
+function void
+mem_arena_trim(Mem_Arena *a) {
+  a->pos = 0;
+  if (a->committed > 0) mem_arena_decommit_from(a, 0);
+}
+
+function void
+mem_arena_scope_end(Mem_ArenaScope *scope) {
+  mem_arena_pop_to(scope->arena, scope->pos);
+}
+
+function void *
+mem_arena_reserve(void *ctx, usize size) {
+  return mem_arena_push(ctx, size);
+}
+
+function void
+mem_arena_release(void *ctx, void *p, usize size) {
+  Mem_Arena *a = ctx;
+  if (p != NULL && (u8 *)p + size == a->mem + a->pos) a->pos = (usize)((u8 *)p - a->mem);
+}
+
+// Only the most recent allocation can grow.
+function bool
+mem_arena_grow(void *ctx, void *p, usize size, usize new_size) {
+  Mem_Arena *a = ctx;
+  if (p == NULL || (u8 *)p + size != a->mem + a->pos) return false;
+  usize start = (usize)((u8 *)p - a->mem);
+  if (new_size > a->reserved - start) return false;
+  if (start + new_size > a->committed && !mem_arena_commit_to(a, start + new_size)) return false;
+  a->pos = start + new_size;
+  return true;
+}
+
+function s32
+mem_arena_init(Mem_Arena *a, usize size, Mem_Tag tag) {
+  size = (size + MEM_ARENA_COMMIT_GRANULARITY - 1) & ~(usize)(MEM_ARENA_COMMIT_GRANULARITY - 1);
+#if OsHasFlags(OS_FLAGS_POSIX)
+  void *mem = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) return errno;
+#else
+# error "No Mem_Arena support for this OS"
+#endif
+  *a = (Mem_Arena){ .mem = mem, .reserved = size, .tag = tag };
+  mem_tag_count(tag, (s64)size, 0, 1, 0);
+  a->base = (Mem_Base){
+    .reserve  = mem_arena_reserve,
+    .commit   = mem_noop_mem_change,
+    .decommit = mem_noop_mem_change,
+    .release  = mem_arena_release,
+    .grow     = mem_arena_grow,
+    .ctx      = a,
+  };
+  return 0;
+}
+
+#define MEM_RESERVED_HEADER ((sizeof(Mem_Arena) + MEM_ARENA_ALIGN - 1) & ~(usize)(MEM_ARENA_ALIGN - 1))
+
+function void
+mem_reserved_release(void *ctx, void *p, usize size) {
+  Mem_Arena *a = ctx;
+  if (p != NULL && (u8 *)p != a->mem + MEM_RESERVED_HEADER) {
+    mem_arena_release(ctx, p, size);
+    return;
+  }
+  // a lives in the range being unmapped.
+  Mem_Arena tmp = *a;
+  mem_arena_destroy(&tmp);
+}
+
+function Mem_Base *
+mem_reserved_base(usize size, Mem_Tag tag) {
+  Mem_Arena tmp;
+  if (mem_arena_init(&tmp, MEM_RESERVED_HEADER + size, tag) != 0) return NULL;
+  Mem_Arena *a = mem_arena_push(&tmp, MEM_RESERVED_HEADER);
+  if (a == NULL) {
+    mem_arena_destroy(&tmp);
+    return NULL;
+  }
+  *a = tmp;
+  a->base.release = mem_reserved_release;
+  a->base.ctx     = a;
+  return &a->base;
+}
+
+function void
+mem_arena_destroy(Mem_Arena *a) {
+  mem_tag_count(a->tag, -(s64)a->reserved, -(s64)a->committed, 0, 1);
+#if OsHasFlags(OS_FLAGS_POSIX)
+  munmap(a->mem, a->reserved);
+#else
+# error "No Mem_Arena support for this OS"
+#endif
+  *a = (Mem_Arena){0};
+}
+
+// A free object links to the next one in its list with its first word; the first object
+// of a batch in a depot links to the next batch with its second.
+typedef struct Mem_SlabFree {
+  struct Mem_SlabFree *next;
+  struct Mem_SlabFree *next_batch;
+} Mem_SlabFree;
+
+typedef struct {
+  _Alignas(CACHE_LINE_SIZE) u32 lock; // spinlock, held for a few pointer writes only
+  Mem_SlabFree *batches;
+} Mem_SlabDepot;
+
+typedef struct {
+  Mem_SlabFree *free[MEM_SLAB_CLASSES];
+  u32           n_free[MEM_SLAB_CLASSES];
+} Mem_SlabCache;
+
+global Mem_SlabDepot mem_slab_depots[MEM_SLAB_CLASSES];
+// Objects cached by a thread that exits are lost: all our threads live as long as the process.
+global _Thread_local Mem_SlabCache mem_slab_cache;
+
+function usize
+mem_slab_class(usize size) {
+  if (size <= 32) return 0;
+  u32   k    = 63 - (u32)__builtin_clzll((u64)size - 1); // 2^k < size <= 2^(k + 1)
+  usize half = (usize)3 << (k - 1);
+  return (k - 5) * 2 + (size <= half ? 1 : 2);
+}
+
+function usize
+mem_slab_class_size(usize c) {
+  if (c == 0) return 32;
+  usize k = 5 + (c - 1) / 2;
+  return (c - 1) % 2 == 0 ? (usize)3 << (k - 1) : (usize)1 << (k + 1);
+}
+
+function Mem_SlabFree *
+mem_slab_obj(u8 *slab, usize size, usize i) {
+  return (Mem_SlabFree *)(void *)(slab + i * size);
+}
+
+function void
+mem_slab_depot_lock(Mem_SlabDepot *d) {
+  while (__atomic_exchange_n(&d->lock, 1, __ATOMIC_ACQUIRE) != 0)
+    while (__atomic_load_n(&d->lock, __ATOMIC_RELAXED) != 0) {}
+}
+
+function void
+mem_slab_depot_unlock(Mem_SlabDepot *d) {
+  __atomic_store_n(&d->lock, 0, __ATOMIC_RELEASE);
+}
+
+// Fills the (empty) cache of class c with a batch from the depot, or with a new slab.
+function bool
+mem_slab_refill(usize c) {
+  Mem_SlabCache *cache = &mem_slab_cache;
+  Mem_SlabDepot *d     = &mem_slab_depots[c];
+  mem_slab_depot_lock(d);
+  Mem_SlabFree *batch = d->batches;
+  if (batch != NULL) d->batches = batch->next_batch;
+  mem_slab_depot_unlock(d);
+  if (batch != NULL) {
+    cache->free[c]   = batch;
+    cache->n_free[c] = MEM_SLAB_BATCH;
+    return true;
+  }
+
+  u8 *slab = malloc(MEM_SLAB_SIZE);
+  if (slab == NULL) return false;
+  usize size = mem_slab_class_size(c);
+  usize n    = MEM_SLAB_SIZE / size; // at least MEM_SLAB_BATCH
+  for (usize i = 0; i < n; i++)
+    mem_slab_obj(slab, size, i)->next = i + 1 < n ? mem_slab_obj(slab, size, i + 1) : NULL;
+  // The cache keeps a batch plus what doesn't make up a whole one, the rest is cut
+  // into batches for the depot. Caching everything would have every release flush.
+  usize keep = MEM_SLAB_BATCH + n % MEM_SLAB_BATCH;
+  mem_slab_obj(slab, size, keep - 1)->next = NULL;
+  cache->free[c]   = mem_slab_obj(slab, size, 0);
+  cache->n_free[c] = (u32)keep;
+  if (keep == n) return true;
+  for (usize i = keep; i < n; i += MEM_SLAB_BATCH) {
+    mem_slab_obj(slab, size, i + MEM_SLAB_BATCH - 1)->next = NULL;
+    mem_slab_obj(slab, size, i)->next_batch = i + MEM_SLAB_BATCH < n ? mem_slab_obj(slab, size, i + MEM_SLAB_BATCH) : NULL;
+  }
+  mem_slab_depot_lock(d);
+  mem_slab_obj(slab, size, n - MEM_SLAB_BATCH)->next_batch = d->batches;
+  d->batches = mem_slab_obj(slab, size, keep);
+  mem_slab_depot_unlock(d);
+  return true;
+}
+
+// Moves MEM_SLAB_BATCH objects from the cache of class c to the depot.
+function void
+mem_slab_flush(usize c) {
+  Mem_SlabCache *cache = &mem_slab_cache;
+  Mem_SlabFree  *batch = cache->free[c];
+  Mem_SlabFree  *last  = batch;
+  for (u32 i = 1; i < MEM_SLAB_BATCH; i++) last = last->next;
+  cache->free[c]    = last->next;
+  cache->n_free[c] -= MEM_SLAB_BATCH;
+  last->next = NULL;
+
+  Mem_SlabDepot *d = &mem_slab_depots[c];
+  mem_slab_depot_lock(d);
+  batch->next_batch = d->batches;
+  d->batches = batch;
+  mem_slab_depot_unlock(d);
+}
+
+function void *
+mem_slab_reserve(void *ctx, usize size) {
+  (void)ctx;
+  if (size > MEM_SLAB_MAX_SIZE) return malloc(size);
+  usize c = mem_slab_class(size);
+  Mem_SlabCache *cache = &mem_slab_cache;
+  if (cache->free[c] == NULL && !mem_slab_refill(c)) return NULL;
+  Mem_SlabFree *obj = cache->free[c];
+  cache->free[c] = obj->next;
+  cache->n_free[c]--;
+  return obj;
+}
+
+function void
+mem_slab_release(void *ctx, void *p, usize size) {
+  (void)ctx;
+  if (p == NULL) return;
+  if (size > MEM_SLAB_MAX_SIZE) {
+    free(p);
+    return;
+  }
+  usize c = mem_slab_class(size);
+  Mem_SlabCache *cache = &mem_slab_cache;
+  Mem_SlabFree  *obj   = p;
+  obj->next = cache->free[c];
+  cache->free[c] = obj;
+  if (++cache->n_free[c] >= 2 * MEM_SLAB_BATCH) mem_slab_flush(c);
+}
+
+function Mem_Base *
+mem_slab_base(void) {
+  StaticAssert(MEM_SLAB_CLASSES == 15 && MEM_SLAB_MAX_SIZE == 4096, "size classes don't cover MEM_SLAB_MAX_SIZE");
+  local Mem_Base base = {
+    .reserve  = mem_slab_reserve,
+    .commit   = mem_noop_mem_change,
+    .decommit = mem_noop_mem_change,
+    .release  = mem_slab_release,
+  };
+  return &base;
+}
+
 function void
 mem_auto_change(Mem_AutoChangeContext *ctx) {
   if (ctx->pp != NULL) ctx->call(ctx->mb, *ctx->pp, ctx->size);
@@ -155,7 +569,7 @@ ststring_length(const char *str, char sentinel) {
 function String
 string_from_st(Mem_Base *mb, const char *str, char sentinel) {
   usize length = ststring_length(str, sentinel);
-  u8    *bytes = mem_reserve(mb, length);
+  u8    *bytes = mem_reserve_commit(mb, length);
   memmove(bytes, str, length);
   return string_from_raw(bytes, length);
 }
@@ -380,7 +794,7 @@ utf8_to_utf16(Mem_Base *mb, String s, ByteOrder bo) {
   StringEachRune(s, codepoint) {
     utf16_length += utf16_encoded_len(codepoint);
   }
-  u16 *buf = mem_reserve(mb, utf16_length * sizeof(u16));
+  u16 *buf = mem_reserve_commit(mb, utf16_length * sizeof(u16));
   usize i = 0;
   StringEachRune(s, codepoint) {
     i += utf16_encode_codepoint(codepoint, &buf[i], bo);
@@ -395,7 +809,7 @@ utf16_to_utf8(Mem_Base *mb, Utf16String s) {
   Utf16StringEachRune(s, codepoint) {
     utf8_length += utf8_encoded_len(codepoint);
   }
-  u8 *buf = mem_reserve(mb, utf8_length);
+  u8 *buf = mem_reserve_commit(mb, utf8_length);
   usize i = 0;
   Utf16StringEachRune(s, codepoint) {
     i += utf8_encode_codepoint(codepoint, &buf[i]);
@@ -427,7 +841,7 @@ string_slice(String s, usize start_at, usize len) {
 function s32
 file_open(Mem_Base *mb, String path, File **f) {
   Assert(f != NULL);
-  *f = mem_reserve(mb, sizeof(File));
+  *f = mem_reserve_commit(mb, sizeof(File));
   char *cpath = string_to_c(mb, path);
 
   s32 fd;
@@ -442,13 +856,13 @@ file_open(Mem_Base *mb, String path, File **f) {
     .fd = fd,
   };
 
-  mem_release(mb, cpath, path.len + 1);
+  mem_decommit_release(mb, cpath, path.len + 1);
   return 0;
 }
 
 function s32
 file_create(Mem_Base *mb, String path, File **f) {
-  *f = mem_reserve(mb, sizeof(File));
+  *f = mem_reserve_commit(mb, sizeof(File));
   char *cpath = string_to_c(mb, path);
 
   s32 fd;
@@ -463,7 +877,7 @@ file_create(Mem_Base *mb, String path, File **f) {
     .fd = fd,
   };
 
-  mem_release(mb, cpath, path.len + 1);
+  mem_decommit_release(mb, cpath, path.len + 1);
   return 0;
 }
 
@@ -505,7 +919,7 @@ file_close(File *f) {
     default:    return errno;
     }
   }
-  mem_release(f->mb, f, sizeof(File));
+  mem_decommit_release(f->mb, f, sizeof(File));
   return 0;
 #else
 # error "file_close is not implemented for this OS"
@@ -544,6 +958,15 @@ file_get_size(File *f, usize *size) {
 #endif
 }
 
+function s32
+mutex_init(Mutex *m) {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  return pthread_mutex_init(&m->inner, NULL);
+#else
+# error "No mutex_init support for this OS"
+#endif
+}
+
 function MutexGuard
 mutex_lock(Mutex *m) {
 #if OsHasFlags(OS_FLAGS_POSIX)
@@ -574,6 +997,525 @@ mutex_guard_unlock(MutexGuard *g) {
 #endif
 }
 
+function s32
+semaphore_init(Semaphore *s, u32 value) {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  return sem_init(&s->inner, 0, value) == 0 ? 0 : errno;
+#else
+# error "No semaphore_init support for this OS"
+#endif
+}
+
+function void
+semaphore_post(Semaphore *s) {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  sem_post(&s->inner);
+#else
+# error "No semaphore_post support for this OS"
+#endif
+}
+
+function void
+semaphore_wait(Semaphore *s) {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  while (sem_wait(&s->inner) == -1 && errno == EINTR) {}
+#else
+# error "No semaphore_wait support for this OS"
+#endif
+}
+
+#if IsCompiler(COMPILER_GCC) || IsCompiler(COMPILER_CLANG)
+function void
+mpmc_init(MpmcQueue *q, Mem_Base *mb, usize capacity) {
+  Assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+  q->cells = mem_reserve_commit(mb, capacity * sizeof(MpmcCell));
+  q->mask  = capacity - 1;
+  for (usize i = 0; i < capacity; i++) {
+    q->cells[i] = (MpmcCell){ .seq = i, .data = NULL };
+  }
+  q->enqueue_pos = 0;
+  q->dequeue_pos = 0;
+}
+
+function bool
+mpmc_push(MpmcQueue *q, void *data) {
+  usize pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+  MpmcCell *cell;
+  while (true) {
+    cell = &q->cells[pos & q->mask];
+    usize seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    ssize diff = (ssize)seq - (ssize)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return false; // the consumers haven't freed this cell yet
+    } else {
+      pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  cell->data = data;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+function bool
+mpmc_pop(MpmcQueue *q, void **data) {
+  usize pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+  MpmcCell *cell;
+  while (true) {
+    cell = &q->cells[pos & q->mask];
+    usize seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    ssize diff = (ssize)seq - (ssize)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return false; // no producer has filled this cell yet
+    } else {
+      pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  *data = cell->data;
+  __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+function void
+mpsc_init(MpscQueue *q) {
+  q->stub.next = NULL;
+  q->head = &q->stub;
+  q->tail = &q->stub;
+}
+
+function void
+mpsc_push(MpscQueue *q, MpscNode *n) {
+  __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+  MpscNode *prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+function MpscNode *
+mpsc_pop(MpscQueue *q) {
+  MpscNode *tail = q->tail;
+  MpscNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (tail == &q->stub) {
+    if (next == NULL) return NULL;
+    q->tail = next;
+    tail = next;
+    next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+  }
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+    return NULL; // a producer is between its exchange and linking prev->next
+  // tail is the last node: put the stub behind it so tail can be handed out.
+  mpsc_push(q, &q->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next != NULL) {
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+#else
+# error "No lock-free queue support for this compiler"
+#endif
+
+function s32
+thread_spawn(Thread *t, ThreadFunc *f, void *ctx) {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  return pthread_create(&t->inner, NULL, f, ctx);
+#else
+# error "No thread_spawn support for this OS"
+#endif
+}
+
+function s32
+thread_join(Thread *t) {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  return pthread_join(t->inner, NULL);
+#else
+# error "No thread_join support for this OS"
+#endif
+}
+
+function usize
+os_cpu_count(void) {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (usize)n : 1;
+#else
+# error "No os_cpu_count support for this OS"
+#endif
+}
+
+function u64
+os_now_ms(void) {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000 + (u64)ts.tv_nsec / 1000000;
+#else
+# error "No os_now_ms support for this OS"
+#endif
+}
+
+function u64
+os_now_ns(void) {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+#else
+# error "No os_now_ns support for this OS"
+#endif
+}
+
+function void
+timer_wheel_init(TimerWheel *tw, u64 now) {
+  *tw = (TimerWheel){ .now = now };
+}
+
+function bool
+timer_armed(Timer *t) {
+  return t->pprev != NULL;
+}
+
+function void
+timer_wheel_place(TimerWheel *tw, Timer *t) {
+  u64 expires = Max(t->expires, tw->now);
+  u64 delta   = expires - tw->now;
+  usize level = 0;
+  while (level + 1 < TIMER_WHEEL_LEVELS && delta >= (1ull << (TIMER_WHEEL_SLOT_BITS * (level + 1))))
+    level++;
+  u64 span = 1ull << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS);
+  if (delta >= span) expires = tw->now + span - 1; // parked, placed again when its slot comes around
+  usize slot = (usize)(expires >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+
+  Timer **head = &tw->slots[level][slot];
+  t->next  = *head;
+  t->pprev = head;
+  if (*head != NULL) (*head)->pprev = &t->next;
+  *head = t;
+  tw->occupied[level] |= 1ull << slot;
+}
+
+function void
+timer_arm(TimerWheel *tw, Timer *t, u64 expires, TimerFunc *fire, void *ctx) {
+  if (timer_armed(t)) timer_cancel(tw, t);
+  t->expires = expires;
+  t->fire    = fire;
+  t->ctx     = ctx;
+  timer_wheel_place(tw, t);
+  tw->count++;
+}
+
+function void
+timer_wheel_unlink(TimerWheel *tw, Timer *t) {
+  *t->pprev = t->next;
+  if (t->next != NULL) t->next->pprev = t->pprev;
+  // If t was the last one in its slot, the head of the slot is now NULL: find out which.
+  if (t->next == NULL) {
+    for (usize level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+      Timer **slots = tw->slots[level];
+      if (t->pprev >= &slots[0] && t->pprev < &slots[TIMER_WHEEL_SLOTS]) {
+        if (*t->pprev == NULL) tw->occupied[level] &= ~(1ull << (t->pprev - slots));
+        break;
+      }
+    }
+  }
+  t->next  = NULL;
+  t->pprev = NULL;
+}
+
+function void
+timer_cancel(TimerWheel *tw, Timer *t) {
+  if (!timer_armed(t)) return;
+  timer_wheel_unlink(tw, t);
+  tw->count--;
+}
+
+function void
+timer_wheel_cascade(TimerWheel *tw, usize level, usize slot) {
+  Timer *t = tw->slots[level][slot];
+  tw->slots[level][slot] = NULL;
+  tw->occupied[level] &= ~(1ull << slot);
+  while (t != NULL) {
+    Timer *next = t->next;
+    timer_wheel_place(tw, t);
+    t = next;
+  }
+}
+
+function void
+timer_wheel_advance(TimerWheel *tw, u64 now) {
+  if (tw->count == 0) {
+    tw->now = Max(tw->now, now + 1);
+    return;
+  }
+  while (tw->now <= now) {
+    usize slot = (usize)tw->now & (TIMER_WHEEL_SLOTS - 1);
+    // Entering a new rotation of a level: move the timers in the now current slot of
+    // the level above down to where they belong.
+    for (usize level = 1; slot == 0 && level < TIMER_WHEEL_LEVELS; level++) {
+      usize upper = (usize)(tw->now >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+      timer_wheel_cascade(tw, level, upper);
+      if (upper != 0) break;
+    }
+    // Everything left in this slot expires now. Callbacks may arm and cancel timers.
+    Timer **head = &tw->slots[0][(usize)tw->now & (TIMER_WHEEL_SLOTS - 1)];
+    while (*head != NULL) {
+      Timer *t = *head;
+      timer_cancel(tw, t);
+      t->fire(t, t->ctx);
+    }
+    // Nothing left on level 0: skip straight to the next tick that cascades (or to now).
+    if (tw->occupied[0] == 0) tw->now = Min((tw->now | (TIMER_WHEEL_SLOTS - 1)) + 1, now + 1);
+    else                      tw->now++;
+    if (tw->count == 0) {
+      tw->now = now + 1;
+      break;
+    }
+  }
+}
+
+function u64
+timer_wheel_idle_ticks(TimerWheel *tw) {
+  if (tw->count == 0) return U64_MAX;
+  u64 best = U64_MAX;
+  for (usize level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    u64 occupied = tw->occupied[level];
+    if (occupied == 0) continue;
+    usize shift = TIMER_WHEEL_SLOT_BITS * level;
+    usize pos   = (usize)(tw->now >> shift) & (TIMER_WHEEL_SLOTS - 1);
+    // Distance (in slots of this level) to the next occupied one, counting from pos.
+    u64 rotated = (occupied >> pos) | (pos != 0 ? occupied << (TIMER_WHEEL_SLOTS - pos) : 0);
+    u64 slots   = (u64)__builtin_ctzll(rotated);
+    u64 into    = tw->now & ((1ull << shift) - 1); // ticks already spent in the current slot
+    u64 ticks;
+    if (level == 0)           ticks = slots;
+    else if (slots != 0)      ticks = (slots << shift) - into;
+    else if (into == 0)       ticks = 0; // due for cascading right away
+    else                      ticks = ((u64)TIMER_WHEEL_SLOTS << shift) - into; // parked: next rotation
+    best = Min(best, ticks);
+  }
+  return best;
+}
+
+function usize
+lz_compress_bound(usize n) {
+  return n + n / 255 + 16;
+}
+
+function u32
+lz_load32(const u8 *p) {
+  u32 x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+// Appends a sequence at dst + op; match_len is 0 for the last one. Returns the new op,
+// or 0 if the sequence doesn't fit.
+function usize
+lz_put_sequence(u8 *dst, usize cap, usize op, const u8 *lit, usize lit_len, usize offset, usize match_len) {
+  if (1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1 > cap - op) return 0;
+  u8 *token = &dst[op++];
+  *token = (u8)(Min(lit_len, 15) << 4);
+  if (lit_len >= 15) {
+    usize l = lit_len - 15;
+    for (; l >= 255; l -= 255) dst[op++] = 255;
+    dst[op++] = (u8)l;
+  }
+  memcpy(dst + op, lit, lit_len);
+  op += lit_len;
+  if (match_len == 0) return op;
+
+  dst[op++] = (u8)offset;
+  dst[op++] = (u8)(offset >> 8);
+  usize m = match_len - LZ_MIN_MATCH;
+  *token |= (u8)Min(m, 15);
+  if (m >= 15) {
+    m -= 15;
+    for (; m >= 255; m -= 255) dst[op++] = 255;
+    dst[op++] = (u8)m;
+  }
+  return op;
+}
+
+// Follows the rules of the LZ4 block format: the last match starts at least 12 bytes
+// before the end, and the last 5 bytes are always literals.
+function usize
+lz_compress(const u8 *src, usize n, u8 *dst, usize cap) {
+  u32 table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+  usize ip = 0, anchor = 0, op = 0;
+  if (n > 12) {
+    usize match_limit = n - 12, end_limit = n - 5;
+    while (ip < match_limit) {
+      u32 seq = lz_load32(src + ip);
+      u32 h   = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+      usize ref = table[h];
+      table[h]  = (u32)ip;
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_load32(src + ref) != seq) {
+        ip++;
+        continue;
+      }
+      while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+        ip--;
+        ref--;
+      }
+      usize len = LZ_MIN_MATCH;
+      while (ip + len < end_limit && src[ip + len] == src[ref + len]) len++;
+      op = lz_put_sequence(dst, cap, op, src + anchor, ip - anchor, ip - ref, len);
+      if (op == 0) return 0;
+      ip += len;
+      anchor = ip;
+    }
+  }
+  return lz_put_sequence(dst, cap, op, src + anchor, n - anchor, 0, 0);
+}
+
+// Reads the bytes continuing a length nibble of 15.
+function bool
+lz_get_length(const u8 *src, usize n, usize *ip, usize *len) {
+  u8 b;
+  do {
+    if (*ip >= n) return false;
+    b = src[(*ip)++];
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+function bool
+lz_decompress(const u8 *src, usize n, u8 *dst, usize len) {
+  usize ip = 0, op = 0;
+  while (ip < n) {
+    u8 token = src[ip++];
+    usize lit = (usize)(token >> 4);
+    if (lit == 15 && !lz_get_length(src, n, &ip, &lit)) return false;
+    if (lit > n - ip || lit > len - op) return false;
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == n) break; // that was the last sequence
+
+    if (n - ip < 2) return false;
+    usize offset = (usize)src[ip] | ((usize)src[ip + 1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op) return false;
+    usize m = token & 15;
+    if (m == 15 && !lz_get_length(src, n, &ip, &m)) return false;
+    m += LZ_MIN_MATCH;
+    if (m > len - op) return false;
+    u8 *d = dst + op;
+    const u8 *r = d - offset;
+    if (offset >= m) memcpy(d, r, m);
+    else for (usize i = 0; i < m; i++) d[i] = r[i]; // overlapping: repeats the last offset bytes
+    op += m;
+  }
+  return op == len;
+}
+
+#if ENABLE_TRACE
+global TraceRing *trace_rings;
+global u32        trace_next_tid;
+global u64        trace_origin_tsc;
+global u64        trace_origin_ns;
+global _Thread_local TraceRing *trace_ring;
+
+// rdtsc doesn't serialize, so an event may be off by a few dozen cycles.
+// That's far below what a trace is looked at for, and a lot cheaper than rdtscp or a fence.
+function u64
+trace_clock(void) {
+# if INTEL_INTRINSICS_AVAILABLE
+  return __rdtsc();
+# else
+  return os_now_ns();
+# endif
+}
+
+function TraceRing *
+trace_ring_create(void) {
+  TraceRing *r = mem_reserve_commit(mem_malloc_base(), sizeof(TraceRing));
+  memset(r, 0, OffsetOfMember(TraceRing, events));
+  r->tid = __atomic_add_fetch(&trace_next_tid, 1, __ATOMIC_RELAXED);
+  snprintf(r->thread_name, sizeof(r->thread_name), "thread %u", r->tid);
+  // Whoever gets here first sets the origin that timestamps are converted against.
+  u64 zero = 0;
+  u64 now_ns = os_now_ns(), now_tsc = trace_clock();
+  if (__atomic_compare_exchange_n(&trace_origin_tsc, &zero, now_tsc, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    __atomic_store_n(&trace_origin_ns, now_ns, __ATOMIC_RELEASE);
+  r->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&trace_rings, &r->next, r, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+  return r;
+}
+
+function void
+trace_event(const char *name, u8 phase, u64 id) {
+  TraceRing *r = trace_ring;
+  if (Unlikely(r == NULL)) r = trace_ring = trace_ring_create();
+  u64 head = r->head;
+  r->events[head & (TRACE_RING_EVENTS - 1)] = (TraceEvent){ .tsc = trace_clock(), .name = name, .id = id, .phase = phase };
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+function void
+trace_thread_name(const char *name) {
+  if (trace_ring == NULL) trace_ring = trace_ring_create();
+  snprintf(trace_ring->thread_name, sizeof(trace_ring->thread_name), "%s", name);
+}
+
+// Rings are written to without any locking, so an event that may have been overwritten
+// while it was copied out (its slot was reused by the time we're done) is dropped.
+// The very oldest events of a busy thread may be missing from a dump because of that.
+function s32
+trace_dump(FILE *f) {
+  u64 origin_tsc = __atomic_load_n(&trace_origin_tsc, __ATOMIC_ACQUIRE);
+  u64 origin_ns  = __atomic_load_n(&trace_origin_ns, __ATOMIC_ACQUIRE);
+  u64 now_tsc = trace_clock(), now_ns = os_now_ns();
+  f64 ns_per_tick = now_tsc > origin_tsc ? (f64)(now_ns - origin_ns) / (f64)(now_tsc - origin_tsc) : 1.0;
+
+  TraceEvent *copy = mem_reserve_commit(mem_malloc_base(), sizeof(TraceEvent) * TRACE_RING_EVENTS);
+  bool first = true;
+  fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", f);
+  for (TraceRing *r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+    fprintf(f, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",", r->tid, r->thread_name);
+    first = false;
+
+    u64 head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    u64 base = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+    for (u64 i = base; i < head; i++) copy[i - base] = r->events[i & (TRACE_RING_EVENTS - 1)];
+    // Meanwhile the owner may have reused the slots of everything below
+    // after - TRACE_RING_EVENTS, and may be halfway through reusing the next one.
+    u64 after = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    u64 start = after + 1 > TRACE_RING_EVENTS ? Max(after + 1 - TRACE_RING_EVENTS, base) : base;
+
+    // Events whose begin has been overwritten would show up as unbalanced ends.
+    usize depth = 0;
+    for (u64 i = start; i < head; i++) {
+      TraceEvent *e = &copy[i - base];
+      if (e->phase == 'E') {
+        if (depth == 0) continue;
+        depth--;
+      } else {
+        depth++;
+      }
+      f64 us = (f64)(s64)(e->tsc - origin_tsc) * ns_per_tick / 1000.0;
+      fprintf(f, ",\n{\"ph\":\"%c\",\"name\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"id\":%llu}}",
+              e->phase, e->name, r->tid, us, (unsigned long long)e->id);
+    }
+  }
+  fputs("\n]}\n", f);
+  mem_decommit_release(mem_malloc_base(), copy, sizeof(TraceEvent) * TRACE_RING_EVENTS);
+  return ferror(f) ? EIO : 0;
+}
+#endif
+
 function ssize
 io_read(Io_Reader *r, u8 *dest, usize n) {
   return r->read(r->ctx, dest, n);
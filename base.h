@@ -189,12 +189,14 @@ struct Mem_Base;
 
 typedef void *Mem_ReserveFunc(void *ctx, usize size);
 typedef void  Mem_ChangeFunc(void *ctx, void *p, usize size);
+typedef bool  Mem_GrowFunc(void *ctx, void *p, usize size, usize new_size);
 
 typedef struct Mem_Base {
   Mem_ReserveFunc *reserve;
   Mem_ChangeFunc  *commit;
   Mem_ChangeFunc  *decommit;
   Mem_ChangeFunc  *release;
+  Mem_GrowFunc    *grow; // optional, extends a block in place (committed) if it can
   void            *ctx;
 } Mem_Base;
 
@@ -204,6 +206,9 @@ function void  mem_decommit(Mem_Base *mb, void *p, usize size);
 function void  mem_release(Mem_Base *mb, void *p, usize size);
 function void *mem_reserve_commit(Mem_Base *mb, usize size);
 function void  mem_decommit_release(Mem_Base *mb, void *p, usize size);
+// Makes the block p of size bytes new_size bytes long without moving it.
+// Returns false if it can't, then the block is left as it was.
+function bool  mem_grow(Mem_Base *mb, void *p, usize size, usize new_size);
 
 function void  mem_noop_mem_change(void *ctx, void *p, usize size);
 
@@ -224,6 +229,117 @@ function void mem_auto_change(Mem_AutoChangeContext *ctx);
 
 #define MemReserveAutoRelease(mb, target_type, target, size) target_type target = mem_reserve(mb, size); MemAutoChange_(mb, &target, size, mem_release)
 
+// Memory is counted per tag, to tell where it goes. Every thread adds to counters of its
+// own, and only moves them to the global totals once they've changed by MEM_TAG_FLUSH_BYTES
+// or MEM_TAG_FLUSH_COUNT operations, so the totals (and the high-water marks, which are
+// taken of them) can be off by that much per thread.
+#define XM_MEM_TAGS \
+  X(Tls,           "tls")             \
+  X(ClientBuffers, "client_buffers")  \
+  X(Scratch,       "handler_scratch") \
+  X(Compiler,      "compiler")
+
+typedef enum Mem_Tag {
+  Mem_Tag_None, // not counted
+#define X(name, label) Glue(Mem_Tag_, name),
+  XM_MEM_TAGS
+#undef X
+  Mem_Tag_COUNT,
+} Mem_Tag;
+
+#define MEM_TAG_FLUSH_BYTES (256 << 10)
+#define MEM_TAG_FLUSH_COUNT 1024
+
+typedef struct Mem_TagStats {
+  u64 reserved;       // bytes
+  u64 committed;      // bytes
+  u64 peak_committed; // high-water mark of committed
+  u64 reservations;   // ever made
+  u64 releases;       // ever made
+} Mem_TagStats;
+
+function void         mem_tag_count(Mem_Tag tag, s64 reserved, s64 committed, u64 reservations, u64 releases);
+function Mem_TagStats mem_tag_stats(Mem_Tag tag);
+function const char  *mem_tag_name(Mem_Tag tag);
+
+// A Mem_Base counting everything that goes through it under tag, then passing it on to backing.
+typedef struct Mem_Accounting {
+  Mem_Base  base; // allocate through this, its ctx points back at the accounting
+  Mem_Base *backing;
+  Mem_Tag   tag;
+} Mem_Accounting;
+
+// a must not move afterwards, its base points back at it.
+function void mem_accounting_init(Mem_Accounting *a, Mem_Base *backing, Mem_Tag tag);
+
+// A Mem_Base over one range of address space, reserved up front. Allocating bumps a
+// position, and pages are committed in MEM_ARENA_COMMIT_GRANULARITY steps as it first
+// crosses them. Only the most recent allocation can be released on its own; everything
+// else goes at once by moving the position back to one saved earlier (mem_arena_pop_to).
+// What reserve hands out is committed already (not every user of Mem_Base commits),
+// so commit and decommit through the base do nothing. Not thread-safe.
+#define MEM_ARENA_ALIGN              16
+#define MEM_ARENA_COMMIT_GRANULARITY (64 << 10)
+// Popping keeps this much committed past the new position, so an arena that's filled
+// and popped over and over again doesn't make syscalls every time.
+#define MEM_ARENA_KEEP_COMMITTED     (1 << 20)
+
+#if OsHasFlags(OS_FLAGS_POSIX)
+# include <sys/mman.h>
+#endif
+
+typedef struct Mem_Arena {
+  Mem_Base base; // allocate through this, its ctx points back at the arena
+  u8   *mem;
+  usize reserved;
+  usize committed; // from mem on, a multiple of MEM_ARENA_COMMIT_GRANULARITY
+  usize pos;
+  Mem_Tag tag; // the pages are counted under
+} Mem_Arena;
+
+// Reserves size bytes (rounded up to MEM_ARENA_COMMIT_GRANULARITY) of address space.
+// Returns 0 or an errno value. a must not move afterwards, its base points back at it.
+function s32   mem_arena_init(Mem_Arena *a, usize size, Mem_Tag tag);
+function void  mem_arena_destroy(Mem_Arena *a);
+// NULL once the reserved range is used up (or pages can't be committed).
+function void *mem_arena_push(Mem_Arena *a, usize size);
+function usize mem_arena_pos(Mem_Arena *a);
+// Frees everything allocated since the position was pos.
+function void  mem_arena_pop_to(Mem_Arena *a, usize pos);
+function void  mem_arena_clear(Mem_Arena *a);
+// Like mem_arena_clear, but hands back every committed page, for arenas that sit idle.
+function void  mem_arena_trim(Mem_Arena *a);
+
+// A base for a single block that grows in place up to size bytes, never moving, with
+// pages committed as it does: a Mem_Arena living at the start of its own reserved range.
+// Releasing the block (or NULL, if none was ever reserved) unmaps all of it, base included.
+// Reserving more than size bytes in all fails. NULL if the address space can't be reserved.
+function Mem_Base *mem_reserved_base(usize size, Mem_Tag tag);
+
+// A Mem_Base for small objects, in size classes of 32, 48, 64, 96, ... up to MEM_SLAB_MAX_SIZE
+// bytes (two per power of two, so at most a third is wasted). Every thread keeps a free
+// list per class and only takes objects from / hands them back to the global depot of
+// the class MEM_SLAB_BATCH at a time, so it rarely touches shared state. Objects can be
+// released on any thread, not just the one that reserved them. The depot gets new
+// objects by cutting up MEM_SLAB_SIZE slabs from malloc; their memory is never given back.
+// Larger reservations go straight to malloc. Commit and decommit do nothing.
+#define MEM_SLAB_MAX_SIZE 4096
+#define MEM_SLAB_CLASSES  15
+#define MEM_SLAB_BATCH    16
+#define MEM_SLAB_SIZE     (64 << 10)
+
+function Mem_Base *mem_slab_base(void);
+
+typedef struct {
+  Mem_Arena *arena;
+  usize      pos;
+} Mem_ArenaScope;
+
+function void mem_arena_scope_end(Mem_ArenaScope *scope);
+
+// Frees everything allocated from arena at the end of the enclosing scope.
+#define MemArenaScope(arena_) Mem_ArenaScope Glue(Glue(mascope_, __LINE__), _) __attribute__((__cleanup__(mem_arena_scope_end))) = { .arena = (arena_), .pos = mem_arena_pos(arena_) }
+
 //----------- Byte ordering stuff -----------
 
 typedef enum {
@@ -364,8 +480,11 @@ function u8    utf16_encode_codepoint(rune codepoint, u16 *s, ByteOrder bo);
 
 #if OsHasFlags(OS_FLAGS_POSIX)
 # include <pthread.h>
+# include <semaphore.h>
 #endif
 
+#define CACHE_LINE_SIZE 64
+
 typedef struct {
 #if OsHasFlags(OS_FLAGS_POSIX)
   pthread_mutex_t inner; 
@@ -381,11 +500,188 @@ typedef struct {
 #define MUTEX_AUTO_UNLOCK __attribute__((__cleanup__(mutex_guard_unlock)))
 #define MutexLockScoped(mutp) MutexGuard Glue(Glue(mlsguard_, __LINE__), _) MUTEX_AUTO_UNLOCK = mutex_lock(mutp)
 
+function s32        mutex_init(Mutex *m);
 function MutexGuard mutex_lock(Mutex *m);
 
 // TODO(rutgerbrf): check m->m, afterwards do: m->m = NULL
 function void mutex_guard_unlock(MutexGuard *m);
 
+typedef struct {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  sem_t inner;
+#else
+# error "No semaphore support for this OS"
+#endif
+} Semaphore;
+
+function s32  semaphore_init(Semaphore *s, u32 value);
+function void semaphore_post(Semaphore *s);
+function void semaphore_wait(Semaphore *s);
+
+// Bounded lock-free multi-producer multi-consumer queue of pointers (Dmitry Vyukov's design).
+// Every cell carries a sequence number telling producers and consumers whose turn it is.
+typedef struct {
+  usize seq;
+  void *data;
+} MpmcCell;
+
+typedef struct {
+  MpmcCell *cells;
+  usize     mask; // capacity - 1, the capacity is a power of two
+  _Alignas(CACHE_LINE_SIZE) usize enqueue_pos;
+  _Alignas(CACHE_LINE_SIZE) usize dequeue_pos;
+} MpmcQueue;
+
+function void mpmc_init(MpmcQueue *q, Mem_Base *mb, usize capacity);
+function bool mpmc_push(MpmcQueue *q, void *data); // false if full
+function bool mpmc_pop(MpmcQueue *q, void **data); // false if empty
+
+// Unbounded intrusive multi-producer single-consumer queue (Dmitry Vyukov's design).
+// Pushing is one atomic exchange and never blocks; embed an MpscNode in the queued
+// structure and get back to it with ParentStartPtr.
+typedef struct MpscNode {
+  struct MpscNode *next;
+} MpscNode;
+
+typedef struct {
+  _Alignas(CACHE_LINE_SIZE) MpscNode *head; // producers
+  _Alignas(CACHE_LINE_SIZE) MpscNode *tail; // consumer
+  MpscNode stub;
+} MpscQueue;
+
+function void      mpsc_init(MpscQueue *q);
+function void      mpsc_push(MpscQueue *q, MpscNode *n);
+// Returns NULL if the queue is empty, or if a producer is halfway through a push
+// (it will be visible once that push completes).
+function MpscNode *mpsc_pop(MpscQueue *q);
+
+//------------- Threads -------------
+
+typedef void *ThreadFunc(void *ctx);
+
+typedef struct {
+#if OsHasFlags(OS_FLAGS_POSIX)
+  pthread_t inner;
+#else
+# error "No thread support for this OS"
+#endif
+} Thread;
+
+function s32   thread_spawn(Thread *t, ThreadFunc *f, void *ctx);
+function s32   thread_join(Thread *t);
+function usize os_cpu_count(void);
+
+//------------- Timers -------------
+
+#if OsHasFlags(OS_FLAGS_POSIX)
+# include <time.h>
+#endif
+
+// Milliseconds and nanoseconds on a monotonic clock, with an arbitrary origin.
+function u64 os_now_ms(void);
+function u64 os_now_ns(void);
+
+struct Timer;
+typedef void TimerFunc(struct Timer *t, void *ctx);
+
+// Intrusive: embed a Timer in whatever it belongs to and get back to it with ParentStartPtr.
+typedef struct Timer {
+  struct Timer  *next;
+  struct Timer **pprev; // NULL while not armed
+  u64        expires;   // tick
+  TimerFunc *fire;
+  void      *ctx;
+} Timer;
+
+// Hierarchical timer wheel (Varghese & Lauck): level L has 64 slots of 64^L ticks each.
+// Arming and cancelling are O(1); a timer moves down a level each time the slot it is
+// in comes around, so it is touched at most TIMER_WHEEL_LEVELS times in total.
+// Timers further out than the wheel spans are parked in the top level until they fit.
+#define TIMER_WHEEL_LEVELS    4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS     (1 << TIMER_WHEEL_SLOT_BITS)
+
+typedef struct TimerWheel {
+  u64    now;   // the next tick to be processed
+  usize  count; // armed timers
+  u64    occupied[TIMER_WHEEL_LEVELS]; // bit i set if slots[level][i] isn't empty
+  Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel;
+
+function void timer_wheel_init(TimerWheel *tw, u64 now);
+function void timer_arm(TimerWheel *tw, Timer *t, u64 expires, TimerFunc *fire, void *ctx);
+function void timer_cancel(TimerWheel *tw, Timer *t);
+function bool timer_armed(Timer *t);
+// Fires, in order, every timer that expires up to and including tick now.
+function void timer_wheel_advance(TimerWheel *tw, u64 now);
+// Ticks until the wheel next has work to do (U64_MAX if no timer is armed). Useful as poll timeout.
+function u64  timer_wheel_idle_ticks(TimerWheel *tw);
+
+//------------- Compression -------------
+// LZ77 in the LZ4 block format, so any LZ4 implementation can read what this writes
+// (and the other way around). A block is a series of sequences:
+//   <token> <more literal length> <literals> <offset, u16 le> <more match length>
+// The high nibble of the token is the literal length, the low one the match length
+// minus LZ_MIN_MATCH; a nibble of 15 continues in bytes that add 0-255 each, 255 meaning
+// another byte follows. The last sequence has just literals (and no offset).
+// Greedy matching against the last position of every 4-byte hash: no entropy coding,
+// so it's fast, and does well on the repetitive text and IDs typical of payloads.
+
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS  12
+
+// Worst case size of the compressed form of n bytes.
+function usize lz_compress_bound(usize n);
+// Returns the compressed size, or 0 if it would take more than cap bytes.
+function usize lz_compress(const u8 *src, usize n, u8 *dst, usize cap);
+// Decompresses exactly len bytes. Safe on untrusted input: false if src is malformed
+// or doesn't decompress to exactly len bytes.
+function bool  lz_decompress(const u8 *src, usize n, u8 *dst, usize len);
+
+//------------- Tracing -------------
+// Begin/end events with TSC timestamps, recorded into a ring buffer per thread that keeps
+// the most recent TRACE_RING_EVENTS of them. Build with -DENABLE_TRACE=1 to get any of this;
+// otherwise the Trace* macros compile to nothing (their arguments aren't even evaluated).
+
+#if !defined(ENABLE_TRACE)
+# define ENABLE_TRACE 0
+#endif
+
+#if !defined(TRACE_RING_EVENTS)
+# define TRACE_RING_EVENTS (1 << 16) // must be a power of two
+#endif
+
+typedef struct {
+  u64         tsc;
+  const char *name; // must outlive the ring, e.g. a string literal
+  u64         id;   // shown as args.id: the client, response ID, byte count, ...
+  u8          phase; // 'B' or 'E'
+} TraceEvent;
+
+typedef struct TraceRing {
+  struct TraceRing *next; // every ring ever created, newest first
+  u32   tid;
+  char  thread_name[32]; // shown next to the tid
+  u64   head; // events written so far, published with release stores
+  TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+#if ENABLE_TRACE
+function void trace_event(const char *name, u8 phase, u64 id);
+function void trace_thread_name(const char *name);
+// Writes the events of every thread in the Chrome trace event format (JSON), which
+// chrome://tracing and Perfetto load. May be called from any thread while tracing goes on.
+function s32  trace_dump(FILE *f);
+# define TraceBegin(name, id)   trace_event(name, 'B', (u64)(id))
+# define TraceEnd(name, id)     trace_event(name, 'E', (u64)(id))
+# define TraceThreadName(name)  trace_thread_name(name)
+#else
+# define TraceBegin(name, id)   ((void)0)
+# define TraceEnd(name, id)     ((void)0)
+# define TraceThreadName(name)  ((void)0)
+#endif
+
 //--------------- I/O Base ---------------
 
 typedef ssize Io_RwFunc(void *ctx, u8 *dest, usize n);
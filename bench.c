@@ -0,0 +1,726 @@
+#define _GNU_SOURCE // ppoll
+
+#include "base.h"
+#include "rpc.h"
+
+#include "base.c"
+#include "rpc.c"
+
+#include <math.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <mbedtls/bignum.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/x509_crt.h>
+
+// rpc_bench: open-loop load generator for the RPC server.
+//
+// Unless pointed at another server with -e, it runs one in-process (on port RPC_PORT,
+// with a self-signed certificate it generates if cert.pem/key.pem don't exist yet),
+// opens connections to it over TLS and sends a mix of requests at a fixed rate,
+// pipelined, whether or not earlier ones have been answered.
+// Latency is measured from when a request was due to be sent rather than from when
+// it went out, so a server that falls behind shows up as latency instead of as a
+// lower request rate (no coordinated omission).
+
+// Outside the reserved range, only served by the in-process server.
+#define BENCH_PROC_ECHO    0x80
+#define BENCH_PROC_MISSING 0x81 // never registered, exercises the NotFound path
+
+typedef struct BenchProc {
+  const char *name;
+  u64 uid;
+} BenchProc;
+
+global const BenchProc bench_procs[] = {
+  { "ping",    RPC_PROC_PING      },
+  { "echo",    BENCH_PROC_ECHO    },
+  { "missing", BENCH_PROC_MISSING },
+};
+#define BENCH_MAX_PROCS ArrayCount(bench_procs)
+
+#define BENCH_MAX_OUTSTANDING 4096 // per connection, further requests wait until answers come in
+#define BENCH_READ_CHUNK      (64 << 10)
+#define BENCH_DRAIN_NS        (2ull * 1000 * 1000 * 1000) // how long to wait for answers after the run
+
+typedef struct BenchConfig {
+  const char *host;
+  const char *port;
+  usize connections;
+  usize threads;
+  u64   rate;       // requests per second, over all connections
+  u64   duration_s; // measured
+  u64   warmup_s;   // not measured, runs before duration_s
+  usize payload;    // bytes, for echo
+  u32   weights[BENCH_MAX_PROCS];
+  bool  external;   // don't start a server, connect to host:port
+  usize server_workers;
+  usize server_handler_threads;
+} BenchConfig;
+
+//------------- Histogram -------------
+
+// Log-linear histogram in the style of HdrHistogram, of latencies in nanoseconds:
+// 3 significant digits (2048 sub-buckets per power of two) from 1 ns to over a minute.
+#define HIST_SUB_BUCKET_BITS 11
+#define HIST_SUB_BUCKETS     (1 << HIST_SUB_BUCKET_BITS)
+#define HIST_HALF_BITS       (HIST_SUB_BUCKET_BITS - 1)
+#define HIST_HALF            (1 << HIST_HALF_BITS)
+#define HIST_BUCKETS         26
+#define HIST_COUNTS          ((HIST_BUCKETS + 1) << HIST_HALF_BITS)
+#define HIST_MAX_VALUE       (((u64)HIST_SUB_BUCKETS << (HIST_BUCKETS - 1)) - 1)
+#define HIST_TICKS_PER_HALF  5 // percentile lines per halving of the distance to 100%
+
+typedef struct Histogram {
+  u64 counts[HIST_COUNTS];
+  u64 total;
+  u64 max;
+} Histogram;
+
+function usize
+hist_index(u64 v) {
+  v = Min(v, HIST_MAX_VALUE);
+  u32 bucket = (u32)(64 - __builtin_clzll(v | (HIST_SUB_BUCKETS - 1))) - HIST_SUB_BUCKET_BITS;
+  return ((usize)(bucket + 1) << HIST_HALF_BITS) + (usize)((v >> bucket) - HIST_HALF);
+}
+
+// Largest value that lands in counts[i].
+function u64
+hist_value(usize i) {
+  u32 bucket = (u32)(i >> HIST_HALF_BITS);
+  u64 sub    = (i & (HIST_HALF - 1)) + HIST_HALF;
+  if (bucket == 0) sub -= HIST_HALF;
+  else             bucket--;
+  return (sub << bucket) + ((u64)1 << bucket) - 1;
+}
+
+function void
+hist_record(Histogram *h, u64 v) {
+  h->counts[hist_index(v)]++;
+  h->total++;
+  h->max = Max(h->max, v);
+}
+
+function void
+hist_merge(Histogram *into, Histogram *h) {
+  for (usize i = 0; i < HIST_COUNTS; i++) into->counts[i] += h->counts[i];
+  into->total += h->total;
+  into->max    = Max(into->max, h->max);
+}
+
+function u64
+hist_percentile(Histogram *h, f64 p) {
+  if (h->total == 0) return 0;
+  u64 want = (u64)(p / 100.0 * (f64)h->total + 0.5);
+  want = ClampBot(want, 1);
+  u64 seen = 0;
+  for (usize i = 0; i < HIST_COUNTS; i++) {
+    seen += h->counts[i];
+    if (seen >= want) return Min(hist_value(i), h->max);
+  }
+  return h->max;
+}
+
+// Prints the percentile distribution in the format of HdrHistogram's
+// outputPercentileDistribution (values in microseconds), so existing plotting tools read it.
+function void
+hist_print(Histogram *h, FILE *f) {
+  fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+  if (h->total == 0) return;
+  f64 sum = 0, sum_sq = 0;
+  u64 seen = 0;
+  f64 next = 0; // percentile to print next
+  usize last = 0;
+  for (usize i = 0; i < HIST_COUNTS; i++) {
+    if (h->counts[i] == 0) continue;
+    f64 us = (f64)hist_value(i) / 1000.0;
+    sum    += us * (f64)h->counts[i];
+    sum_sq += us * us * (f64)h->counts[i];
+    seen   += h->counts[i];
+    last    = i;
+    while (seen < h->total && (f64)seen * 100.0 / (f64)h->total >= next) {
+      fprintf(f, "%12.3f %2.12f %10llu %14.2f\n", us, next / 100.0, (unsigned long long)seen, 1.0 / (1.0 - next / 100.0));
+      u64 halvings = (u64)(100.0 / (100.0 - next));
+      next += 100.0 / (f64)(HIST_TICKS_PER_HALF * ((u64)2 << (63 - __builtin_clzll(halvings))));
+    }
+  }
+  f64 max_us = (f64)Min(hist_value(last), h->max) / 1000.0;
+  fprintf(f, "%12.3f %2.12f %10llu\n", max_us, 1.0, (unsigned long long)h->total);
+  f64 mean = sum / (f64)h->total;
+  f64 var  = sum_sq / (f64)h->total - mean * mean;
+  fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean, var > 0 ? sqrt(var) : 0.0);
+  fprintf(f, "#[Max     = %12.3f, Total count    = %12llu]\n", (f64)h->max / 1000.0, (unsigned long long)h->total);
+  fprintf(f, "#[Buckets = %12d, SubBuckets     = %12d]\n", HIST_BUCKETS, HIST_SUB_BUCKETS);
+}
+
+//------------- Load generator -------------
+
+typedef struct BenchSlot {
+  u64 due;  // ns, when the request was scheduled to go out; 0 marks a free slot
+  u8  proc; // index into bench_procs
+} BenchSlot;
+
+typedef struct BenchConn {
+  mbedtls_net_context fd;
+  mbedtls_ssl_context ssl;
+  u64 next_due; // ns
+  // Response ID i + 1 is slots[i], free ones are listed in free_ids.
+  BenchSlot slots[BENCH_MAX_OUTSTANDING];
+  u16   free_ids[BENCH_MAX_OUTSTANDING];
+  usize n_free;
+  Slice(u8) out;
+  usize outi;
+  usize wretry; // see RpcClient.wretry
+  Slice(u8) in;
+  bool  broken;
+} BenchConn;
+
+typedef struct BenchStats {
+  u64 sent;
+  u64 answered;
+  u64 by_status[256];
+  u64 late;  // requests that went out more than a millisecond after they were due
+  Histogram latency[BENCH_MAX_PROCS];
+} BenchStats;
+
+typedef struct BenchThread {
+  Thread thread;
+  BenchConfig *config;
+  usize first_conn, n_conns;
+  BenchConn *conns;
+  mbedtls_ssl_config       conf;
+  mbedtls_ctr_drbg_context ctr_drbg;
+  mbedtls_entropy_context *entropy;
+  u64 rng;
+  u64 *start; // ns, set by main once every connection is up
+  u32 *ready;
+  bool failed;
+  BenchStats stats;
+} BenchThread;
+
+function u64
+bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+// xorshift64*
+function u64
+bench_rand(u64 *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1Dull;
+}
+
+function u8
+bench_pick_proc(BenchThread *t) {
+  u32 total = 0;
+  for (usize i = 0; i < BENCH_MAX_PROCS; i++) total += t->config->weights[i];
+  u32 r = (u32)(bench_rand(&t->rng) % total);
+  for (usize i = 0; i < BENCH_MAX_PROCS; i++) {
+    if (r < t->config->weights[i]) return (u8)i;
+    r -= t->config->weights[i];
+  }
+  Unreachable("weights don't add up");
+  return 0;
+}
+
+function s32
+bench_connect(BenchThread *t, BenchConn *c) {
+  mbedtls_net_init(&c->fd);
+  s32 s = mbedtls_net_connect(&c->fd, t->config->host, t->config->port, MBEDTLS_NET_PROTO_TCP);
+  if (s != 0) {
+    printf("Failed to connect to %s:%s: -0x%x\n", t->config->host, t->config->port, (u32)-s);
+    return s;
+  }
+  s32 one = 1;
+  setsockopt(c->fd.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  mbedtls_ssl_init(&c->ssl);
+  s = mbedtls_ssl_setup(&c->ssl, &t->conf);
+  if (s != 0) {
+    printf("Failed to run SSL setup: -0x%x\n", (u32)-s);
+    return s;
+  }
+  mbedtls_ssl_set_bio(&c->ssl, &c->fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+  while ((s = mbedtls_ssl_handshake(&c->ssl)) != 0) {
+    if (s == MBEDTLS_ERR_SSL_WANT_READ || s == MBEDTLS_ERR_SSL_WANT_WRITE) continue;
+    printf("SSL handshake failed: -0x%x\n", (u32)-s);
+    return s;
+  }
+  s = mbedtls_net_set_nonblock(&c->fd);
+  if (s != 0) {
+    perror("Failed to make socket non-blocking");
+    return s;
+  }
+  for (usize i = 0; i < BENCH_MAX_OUTSTANDING; i++)
+    c->free_ids[i] = (u16)(BENCH_MAX_OUTSTANDING - 1 - i);
+  c->n_free = BENCH_MAX_OUTSTANDING;
+  c->out = SliceNew(u8, mem_malloc_base());
+  c->in  = SliceNew(u8, mem_malloc_base());
+  return 0;
+}
+
+function void
+bench_append_request(BenchThread *t, BenchConn *c, u64 due) {
+  u8  proc = bench_pick_proc(t);
+  u16 id   = c->free_ids[--c->n_free];
+  c->slots[id] = (BenchSlot){ .due = due, .proc = proc };
+
+  usize payload = bench_procs[proc].uid == BENCH_PROC_ECHO ? t->config->payload : 0;
+  SliceReserve(&c->out, 1 + sizeof(u64) + 2 * RPC_VU64_MAX_LEN + payload);
+  u8 *p = c->out.items + c->out.len;
+  *p++ = RPC_REQUEST_MARKER;
+  u64 uid = bench_procs[proc].uid;
+  for (usize i = 0; i < sizeof(u64); i++) *p++ = (u8)(uid >> (8 * (sizeof(u64) - 1 - i)));
+  p += write_vu64(p, (u64)id + 1);
+  p += write_vu64(p, payload);
+  memset(p, 'x', payload);
+  p += payload;
+  c->out.len = (usize)(p - c->out.items);
+  t->stats.sent++;
+}
+
+function void
+bench_flush(BenchConn *c) {
+  while (c->outi < SliceLen(c->out)) {
+    usize n = c->wretry != 0 ? c->wretry : Min(SliceLen(c->out) - c->outi, (usize)MBEDTLS_SSL_MAX_CONTENT_LEN);
+    s32 s = mbedtls_ssl_write(&c->ssl, c->out.items + c->outi, n);
+    if (s == MBEDTLS_ERR_SSL_WANT_READ || s == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      c->wretry = n;
+      return;
+    }
+    if (s < 0) {
+      printf("mbedtls_ssl_write failed: -0x%x\n", (u32)-s);
+      c->broken = true;
+      return;
+    }
+    c->wretry = 0;
+    c->outi  += (usize)s;
+  }
+  c->out.len = 0;
+  c->outi    = 0;
+}
+
+// Parses every complete response in c->in, then drops them from it.
+function void
+bench_parse_responses(BenchThread *t, BenchConn *c, u64 now, u64 measure_from) {
+  usize i = 0;
+  while (i < SliceLen(c->in)) {
+    String rest = string_from_raw(c->in.items + i + 1, SliceLen(c->in) - i - 1);
+    u64 rid = 0, len = 0;
+    u8  n = 0;
+    usize used_rid, used_len;
+    if (rest.len == 0 || try_read_vu64(rest, &rid, &n, &used_rid) != RpcDecodeStatus_Done) break;
+    n = 0;
+    rest = string_from_raw(rest.buf + used_rid, rest.len - used_rid);
+    if (try_read_vu64(rest, &len, &n, &used_len) != RpcDecodeStatus_Done) break;
+    usize frame = 1 + used_rid + used_len + 1 + (usize)len;
+    if (SliceLen(c->in) - i < frame) break;
+
+    u8 status = c->in.items[i];
+    i += frame;
+    if (rid == 0 || rid > BENCH_MAX_OUTSTANDING || c->slots[rid - 1].due == 0) {
+      printf("Response for unknown response ID %llu\n", (unsigned long long)rid);
+      c->broken = true;
+      return;
+    }
+    BenchSlot *slot = &c->slots[rid - 1];
+    t->stats.answered++;
+    t->stats.by_status[status]++;
+    if (slot->due >= measure_from) hist_record(&t->stats.latency[slot->proc], now - slot->due);
+    slot->due = 0;
+    c->free_ids[c->n_free++] = (u16)(rid - 1);
+  }
+  memmove(c->in.items, c->in.items + i, SliceLen(c->in) - i);
+  c->in.len -= i;
+}
+
+function void
+bench_read(BenchThread *t, BenchConn *c, u64 measure_from) {
+  while (!c->broken) {
+    SliceReserve(&c->in, BENCH_READ_CHUNK);
+    s32 s = mbedtls_ssl_read(&c->ssl, c->in.items + c->in.len, SliceSpare(c->in));
+    if (s == MBEDTLS_ERR_SSL_WANT_READ || s == MBEDTLS_ERR_SSL_WANT_WRITE) return;
+    if (s <= 0) {
+      printf("Connection closed by server: -0x%x\n", (u32)-s);
+      c->broken = true;
+      return;
+    }
+    c->in.len += (usize)s;
+    bench_parse_responses(t, c, bench_now_ns(), measure_from);
+  }
+}
+
+function void *
+bench_thread(void *ctx) {
+  BenchThread *t   = ctx;
+  BenchConfig *cfg = t->config;
+
+  t->conns = mem_reserve_commit(mem_malloc_base(), t->n_conns * sizeof(BenchConn));
+  memset(t->conns, 0, t->n_conns * sizeof(BenchConn));
+  s32 epoll_fd = epoll_create1(0);
+  for (usize i = 0; i < t->n_conns && !t->failed; i++) {
+    BenchConn *c = &t->conns[i];
+    if (bench_connect(t, c) != 0) {
+      t->failed = true;
+      break;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd.fd, &ev);
+  }
+  __atomic_add_fetch(t->ready, 1, __ATOMIC_ACQ_REL);
+  u64 start;
+  while ((start = __atomic_load_n(t->start, __ATOMIC_ACQUIRE)) == 0) usleep(1000);
+  if (t->failed) return NULL;
+
+  // Every connection sends at the same rate, with their schedules spread evenly.
+  u64 interval     = (u64)1000000000 * cfg->connections / cfg->rate;
+  u64 measure_from = start + cfg->warmup_s * 1000000000;
+  u64 end          = measure_from + cfg->duration_s * 1000000000;
+  for (usize i = 0; i < t->n_conns; i++)
+    t->conns[i].next_due = start + interval * (t->first_conn + i) / cfg->connections;
+
+  struct epoll_event events[64];
+  u64 now;
+  while ((now = bench_now_ns()) < end + BENCH_DRAIN_NS) {
+    u64 wake = end + BENCH_DRAIN_NS;
+    usize outstanding = 0;
+    for (usize i = 0; i < t->n_conns; i++) {
+      BenchConn *c = &t->conns[i];
+      if (c->broken) continue;
+      bool queued = false;
+      while (c->next_due <= now && c->next_due < end && c->n_free > 0) {
+        if (now - c->next_due > 1000000) t->stats.late++;
+        bench_append_request(t, c, c->next_due);
+        c->next_due += interval;
+        queued = true;
+      }
+      if (queued && c->wretry == 0) bench_flush(c);
+      if (c->next_due < end && c->n_free > 0) wake = Min(wake, c->next_due);
+      outstanding += BENCH_MAX_OUTSTANDING - c->n_free;
+    }
+    if (now >= end && outstanding == 0) break;
+
+    // ppoll on the epoll descriptor for a timeout finer than epoll_wait's milliseconds.
+    struct pollfd pfd = { .fd = epoll_fd, .events = POLLIN };
+    u64 wait = wake > now ? wake - now : 0;
+    struct timespec ts = { .tv_sec = (time_t)(wait / 1000000000), .tv_nsec = (long)(wait % 1000000000) };
+    if (ppoll(&pfd, 1, &ts, NULL) <= 0) continue;
+    s32 n = epoll_wait(epoll_fd, events, ArrayCount(events), 0);
+    for (s32 i = 0; i < n; i++) {
+      BenchConn *c = events[i].data.ptr;
+      if (c->broken) continue;
+      if (events[i].events & EPOLLIN) bench_read(t, c, measure_from);
+      if (c->outi < SliceLen(c->out)) bench_flush(c);
+    }
+  }
+  for (usize i = 0; i < t->n_conns; i++) {
+    mbedtls_ssl_close_notify(&t->conns[i].ssl);
+    mbedtls_net_free(&t->conns[i].fd);
+    mbedtls_ssl_free(&t->conns[i].ssl);
+  }
+  close(epoll_fd);
+  return NULL;
+}
+
+//------------- In-process server -------------
+
+function void
+bench_echo(RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx) {
+  (void)ctx;
+  RpcResponse rsp = {
+    .client_id  = req.client_id,
+    .request_id = req.request_id,
+    .code   = RpcStatus_Ok,
+    .family = RpcFamilyStatus(RpcStatus_Ok),
+    .data   = SliceNew(u8, &scratch->base),
+  };
+  SliceReserve(&rsp.data, req.data.len);
+  memcpy(rsp.data.items, req.data.buf, req.data.len);
+  rsp.data.len = req.data.len;
+  rpc_server_respond(srv, rsp);
+}
+
+function void *
+bench_server_thread(void *ctx) {
+  run_rpc_server(ctx);
+  return NULL;
+}
+
+function bool
+bench_write_file(const char *path, const u8 *data, usize len, s32 mode) {
+  s32 fd = open(path, O_WRONLY | O_CREAT | O_EXCL, mode);
+  if (fd == -1) return false;
+  bool ok = write(fd, data, len) == (ssize)len;
+  return close(fd) == 0 && ok;
+}
+
+// Writes a self-signed P-256 certificate for localhost to cert.pem and its key to key.pem.
+function s32
+bench_make_cert(void) {
+  mbedtls_entropy_context  entropy;
+  mbedtls_ctr_drbg_context drbg;
+  mbedtls_pk_context       key;
+  mbedtls_x509write_cert   crt;
+  mbedtls_mpi              serial;
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&drbg);
+  mbedtls_pk_init(&key);
+  mbedtls_x509write_crt_init(&crt);
+  mbedtls_mpi_init(&serial);
+
+  local u8 pem[4096];
+  s32 s = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, (const u8 *)"rpc_bench", 9);
+  if (s == 0) s = mbedtls_pk_setup(&key, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY));
+  if (s == 0) s = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(key), mbedtls_ctr_drbg_random, &drbg);
+  if (s == 0) s = mbedtls_mpi_lset(&serial, 1);
+  if (s == 0) {
+    mbedtls_x509write_crt_set_version(&crt, MBEDTLS_X509_CRT_VERSION_3);
+    mbedtls_x509write_crt_set_md_alg(&crt, MBEDTLS_MD_SHA256);
+    mbedtls_x509write_crt_set_subject_key(&crt, &key);
+    mbedtls_x509write_crt_set_issuer_key(&crt, &key);
+    s = mbedtls_x509write_crt_set_subject_name(&crt, "CN=localhost");
+  }
+  if (s == 0) s = mbedtls_x509write_crt_set_issuer_name(&crt, "CN=localhost");
+  if (s == 0) s = mbedtls_x509write_crt_set_serial(&crt, &serial);
+  if (s == 0) s = mbedtls_x509write_crt_set_validity(&crt, "20200101000000", "20991231235959");
+  if (s == 0) s = mbedtls_x509write_crt_pem(&crt, pem, sizeof(pem), mbedtls_ctr_drbg_random, &drbg);
+  if (s == 0 && !bench_write_file("cert.pem", pem, strlen((char *)pem), 0644)) s = -1;
+  if (s == 0) s = mbedtls_pk_write_key_pem(&key, pem, sizeof(pem));
+  if (s == 0 && !bench_write_file("key.pem", pem, strlen((char *)pem), 0600)) s = -1;
+  if (s != 0) printf("Failed to create a self-signed certificate: -0x%x\n", (u32)-s);
+  else        puts("Wrote a self-signed certificate for localhost to cert.pem and key.pem");
+
+  mbedtls_platform_zeroize(pem, sizeof(pem));
+  mbedtls_mpi_free(&serial);
+  mbedtls_x509write_crt_free(&crt);
+  mbedtls_pk_free(&key);
+  mbedtls_ctr_drbg_free(&drbg);
+  mbedtls_entropy_free(&entropy);
+  return s;
+}
+
+//------------- Main -------------
+
+function void
+bench_usage(void) {
+  puts("usage: rpc_bench [options]\n"
+       "  -c N          connections (64)\n"
+       "  -t N          client threads (4)\n"
+       "  -r N          requests per second, over all connections (50000)\n"
+       "  -d S          measured seconds (10)\n"
+       "  -w S          warm-up seconds, not measured (2)\n"
+       "  -m MIX        procedures and weights, from ping, echo and missing (ping:1)\n"
+       "  -s N          echo payload bytes (64)\n"
+       "  -W N          in-process server: workers (2)\n"
+       "  -H N          in-process server: handler threads (0)\n"
+       "  -e HOST:PORT  use a running server instead (only ping is sure to be there)");
+}
+
+function bool
+bench_parse_mix(BenchConfig *cfg, char *mix) {
+  memset(cfg->weights, 0, sizeof(cfg->weights));
+  for (char *item = strtok(mix, ","); item != NULL; item = strtok(NULL, ",")) {
+    char *colon  = strchr(item, ':');
+    u32   weight = 1;
+    if (colon != NULL) {
+      *colon = 0;
+      weight = (u32)strtoul(colon + 1, NULL, 10);
+    }
+    usize i = 0;
+    while (i < BENCH_MAX_PROCS && strcmp(bench_procs[i].name, item) != 0) i++;
+    if (i == BENCH_MAX_PROCS) {
+      printf("Unknown procedure in mix: %s\n", item);
+      return false;
+    }
+    cfg->weights[i] = weight;
+  }
+  u32 total = 0;
+  for (usize i = 0; i < BENCH_MAX_PROCS; i++) total += cfg->weights[i];
+  return total > 0;
+}
+
+s32
+main(s32 argc, char *argv[]) {
+  signal(SIGPIPE, SIG_IGN);
+
+  BenchConfig cfg = {
+    .host        = "localhost",
+    .port        = RPC_PORT,
+    .connections = 64,
+    .threads     = 4,
+    .rate        = 50000,
+    .duration_s  = 10,
+    .warmup_s    = 2,
+    .payload     = 64,
+    .weights     = { 1 },
+    .server_workers = 2,
+  };
+  for (s32 i = 1; i < argc; i++) {
+    char *opt = argv[i];
+    char *val = i + 1 < argc ? argv[i + 1] : NULL;
+    if (opt[0] != '-' || opt[1] == 0 || opt[2] != 0 || val == NULL) {
+      bench_usage();
+      return 2;
+    }
+    i++;
+    switch (opt[1]) {
+    case 'c': cfg.connections = strtoull(val, NULL, 10); break;
+    case 't': cfg.threads     = strtoull(val, NULL, 10); break;
+    case 'r': cfg.rate        = strtoull(val, NULL, 10); break;
+    case 'd': cfg.duration_s  = strtoull(val, NULL, 10); break;
+    case 'w': cfg.warmup_s    = strtoull(val, NULL, 10); break;
+    case 's': cfg.payload     = strtoull(val, NULL, 10); break;
+    case 'W': cfg.server_workers         = strtoull(val, NULL, 10); break;
+    case 'H': cfg.server_handler_threads = strtoull(val, NULL, 10); break;
+    case 'm':
+      if (!bench_parse_mix(&cfg, val)) return 2;
+      break;
+    case 'e': {
+      char *colon = strrchr(val, ':');
+      if (colon == NULL) {
+        bench_usage();
+        return 2;
+      }
+      *colon = 0;
+      cfg.host     = val;
+      cfg.port     = colon + 1;
+      cfg.external = true;
+    } break;
+    default:
+      bench_usage();
+      return 2;
+    }
+  }
+  if (cfg.connections == 0 || cfg.rate == 0 || cfg.duration_s == 0 || cfg.payload > RPC_MAX_PAYLOAD) {
+    bench_usage();
+    return 2;
+  }
+  cfg.threads = ClampTop(ClampBot(cfg.threads, 1), cfg.connections);
+
+  if (!cfg.external) {
+    bool have_cert = access("cert.pem", F_OK) == 0;
+    bool have_key  = access("key.pem", F_OK) == 0;
+    // A certificate without its key (or the other way around) is left alone rather than overwritten.
+    if (have_cert != have_key) {
+      printf("%s exists but %s is missing, remove it to have a self-signed certificate made\n",
+             have_cert ? "cert.pem" : "key.pem", have_cert ? "key.pem" : "cert.pem");
+      return 1;
+    }
+    if (!have_cert && bench_make_cert() != 0) return 1;
+    RpcServerConfig scfg = rpc_server_config_default();
+    scfg.n_workers         = cfg.server_workers;
+    scfg.n_handler_threads = cfg.server_handler_threads;
+    local RpcServer server;
+    s32 s = init_rpc_server(&server, scfg);
+    if (s != 0) return s;
+    rpc_server_reg_handler(&server, rpc_handler_new(BENCH_PROC_ECHO, bench_echo, NULL));
+    Thread server_thread;
+    s = thread_spawn(&server_thread, bench_server_thread, &server);
+    if (s != 0) return s;
+    // Wait for the server to accept connections.
+    for (s32 tries = 0;; tries++) {
+      mbedtls_net_context probe;
+      mbedtls_net_init(&probe);
+      s = mbedtls_net_connect(&probe, cfg.host, cfg.port, MBEDTLS_NET_PROTO_TCP);
+      mbedtls_net_free(&probe);
+      if (s == 0) break;
+      if (tries == 100) {
+        puts("The in-process server didn't come up");
+        return 1;
+      }
+      usleep(20000);
+    }
+  }
+
+  mbedtls_entropy_context entropy;
+  mbedtls_entropy_init(&entropy);
+  BenchThread *threads = mem_reserve_commit(mem_malloc_base(), cfg.threads * sizeof(BenchThread));
+  memset(threads, 0, cfg.threads * sizeof(BenchThread));
+  u64 start = 0;
+  u32 ready = 0;
+  usize first = 0;
+  for (usize i = 0; i < cfg.threads; i++) {
+    BenchThread *t = &threads[i];
+    t->config     = &cfg;
+    t->first_conn = first;
+    t->n_conns    = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads ? 1 : 0);
+    t->entropy    = &entropy;
+    t->rng        = 0x9E3779B97F4A7C15ull * (i + 1);
+    t->start      = &start;
+    t->ready      = &ready;
+    first += t->n_conns;
+
+    mbedtls_ctr_drbg_init(&t->ctr_drbg);
+    s32 s = mbedtls_ctr_drbg_seed(&t->ctr_drbg, mbedtls_entropy_func, &entropy, (const u8 *)"rpc_bench", 9);
+    if (s != 0) {
+      printf("Failed to seed random number generator: -0x%x\n", (u32)-s);
+      return 1;
+    }
+    mbedtls_ssl_config_init(&t->conf);
+    s = mbedtls_ssl_config_defaults(&t->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (s != 0) {
+      printf("Failed to set up SSL config: -0x%x\n", (u32)-s);
+      return 1;
+    }
+    // The certificate is self-signed, and checking it only costs the client anyway.
+    mbedtls_ssl_conf_authmode(&t->conf, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_rng(&t->conf, mbedtls_ctr_drbg_random, &t->ctr_drbg);
+  }
+  // Handshakes draw from the shared entropy source, so set the threads going only now.
+  for (usize i = 0; i < cfg.threads; i++) {
+    s32 s = thread_spawn(&threads[i].thread, bench_thread, &threads[i]);
+    if (s != 0) return s;
+  }
+  while (__atomic_load_n(&ready, __ATOMIC_ACQUIRE) < cfg.threads) usleep(1000);
+  __atomic_store_n(&start, bench_now_ns(), __ATOMIC_RELEASE);
+  for (usize i = 0; i < cfg.threads; i++) thread_join(&threads[i].thread);
+
+  BenchStats *total = mem_reserve_commit(mem_malloc_base(), sizeof(BenchStats));
+  memset(total, 0, sizeof(BenchStats));
+  Histogram  *all   = mem_reserve_commit(mem_malloc_base(), sizeof(Histogram));
+  memset(all, 0, sizeof(Histogram));
+  bool failed = false;
+  for (usize i = 0; i < cfg.threads; i++) {
+    BenchStats *st = &threads[i].stats;
+    failed |= threads[i].failed;
+    total->sent     += st->sent;
+    total->answered += st->answered;
+    total->late     += st->late;
+    for (usize j = 0; j < 256; j++) total->by_status[j] += st->by_status[j];
+    for (usize j = 0; j < BENCH_MAX_PROCS; j++) {
+      hist_merge(&total->latency[j], &st->latency[j]);
+      hist_merge(all, &st->latency[j]);
+    }
+  }
+  if (failed) return 1;
+
+  printf("\n%zu connections on %zu threads, %llu requests/s for %llu s after %llu s of warm-up\n",
+         cfg.connections, cfg.threads, (unsigned long long)cfg.rate,
+         (unsigned long long)cfg.duration_s, (unsigned long long)cfg.warmup_s);
+  printf("sent %llu, answered %llu, unanswered %llu, sent over 1 ms late %llu\n",
+         (unsigned long long)total->sent, (unsigned long long)total->answered,
+         (unsigned long long)(total->sent - total->answered), (unsigned long long)total->late);
+  for (usize j = 0; j < 256; j++) {
+    if (total->by_status[j] != 0)
+      printf("  status %zu: %llu\n", j, (unsigned long long)total->by_status[j]);
+  }
+  printf("throughput %.0f requests/s (measured part)\n", (f64)all->total / (f64)cfg.duration_s);
+  printf("%-8s %10s %10s %10s %10s %10s\n", "", "count", "p50 us", "p99 us", "p999 us", "max us");
+  for (usize j = 0; j <= BENCH_MAX_PROCS; j++) {
+    Histogram  *h    = j < BENCH_MAX_PROCS ? &total->latency[j] : all;
+    const char *name = j < BENCH_MAX_PROCS ? bench_procs[j].name : "all";
+    if (h->total == 0) continue;
+    printf("%-8s %10llu %10.1f %10.1f %10.1f %10.1f\n", name, (unsigned long long)h->total,
+           (f64)hist_percentile(h, 50.0) / 1000.0, (f64)hist_percentile(h, 99.0) / 1000.0,
+           (f64)hist_percentile(h, 99.9) / 1000.0, (f64)h->max / 1000.0);
+  }
+  printf("\n");
+  hist_print(all, stdout);
+  fflush(stdout);
+  // The in-process server has no way to stop, so don't wait for it.
+  _exit(total->sent == total->answered ? 0 : 1);
+}
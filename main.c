@@ -8,14 +8,14 @@
 
 s32
 main(s32 argc, char *argv[]) {
-#if OsHasFlags(OsFlags_Posix)
+#if OsHasFlags(OS_FLAGS_POSIX)
   signal(SIGPIPE, SIG_IGN);
 #endif
 
   puts("Starting RPC server");
 
-  RpcServer server;
-  int s = init_rpc_server(&server);
+  RpcServer server = {0};
+  int s = init_rpc_server(&server, rpc_server_config_default());
   if (s != 0)
     return s;
   return run_rpc_server(&server);
@@ -2,8 +2,154 @@
 
 #include "rpc.h"
 
+function RpcServerConfig
+rpc_server_config_default(void) {
+  return (RpcServerConfig){
+    .n_workers          = 0,
+    .n_handler_threads  = 0,
+    .handler_queue_size = 4096,
+    .buf_pool_chunks    = 256,
+    .session_cache_size = 4096,
+    .session_timeout    = 86400,
+    .session_tickets    = true,
+    .ktls               = false,
+    .client_high_watermark = 1 << 20,
+    .client_low_watermark  = 256 << 10,
+    .max_buffer_memory     = 1ull << 30,
+    .idle_timeout_ms       = 5 * 60 * 1000,
+    .handshake_timeout_ms  = 10 * 1000,
+    .trace_path            = "trace.json",
+    .compress_min_size     = 512,
+    .scratch_reserve       = (usize)256 << 20,
+    .scratch_pool          = 64,
+    .scratch_warm          = 4,
+  };
+}
+
+// The worker whose event loop runs on the current thread, if any.
+global _Thread_local RpcWorker *rpc_current_worker;
+
+// Stats are written by the owning worker only, so plain relaxed stores suffice.
+#define RpcStatInc(x)    __atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+#define RpcStatAdd(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+
 function s32
-init_rpc_server(RpcServer *srv) {
+rpc_worker_init(RpcServer *srv, RpcWorker *w, usize index) {
+  *w = (RpcWorker){
+    .index      = index,
+    .server     = srv,
+    .mb         = mem_malloc_base(),
+    .epoll_fd   = -1,
+    .wake_fd    = -1,
+  };
+  mpsc_init(&w->completions);
+  w->clients    = SliceNew(RpcClientPtr, w->mb);
+  w->free_slots = SliceNew(usize, w->mb);
+  w->dirty      = SliceNew(u64, w->mb);
+  w->paused     = SliceNew(u64, w->mb);
+  timer_wheel_init(&w->timers, os_now_ms());
+  mem_accounting_init(&w->buf_mem, w->mb, Mem_Tag_ClientBuffers);
+  rpc_buf_pool_init(&w->bufs, &w->buf_mem.base, &srv->buffer_memory, srv->config.buf_pool_chunks);
+  mbedtls_net_init(&w->listen_fd);
+
+  s32 s = mem_arena_init(&w->scratch, srv->config.scratch_reserve, Mem_Tag_Scratch);
+  if (s != 0) {
+    errno = s;
+    perror("Failed to reserve scratch memory");
+    return s;
+  }
+
+  mbedtls_ctr_drbg_init(&w->ctr_drbg);
+  const char *pers = "ssl_server";
+  s = mbedtls_ctr_drbg_seed(&w->ctr_drbg, mbedtls_entropy_func, &srv->entropy, (const u8 *)pers, strlen(pers));
+  if (s != 0) {
+    perror("Failed to seed random number generator");
+    return s;
+  }
+
+  mbedtls_ssl_config_init(&w->conf);
+  s = mbedtls_ssl_config_defaults(&w->conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  if (s != 0) {
+    perror("Failed to set up SSL config");
+    return s;
+  }
+
+  mbedtls_ssl_conf_rng(&w->conf, mbedtls_ctr_drbg_random, &w->ctr_drbg);
+  if (srv->config.session_cache_size > 0)
+    mbedtls_ssl_conf_session_cache(&w->conf, &srv->session_cache, rpc_session_cache_get, rpc_session_cache_set);
+  if (srv->config.session_tickets) {
+    mbedtls_ssl_conf_session_tickets(&w->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+    mbedtls_ssl_conf_session_tickets_cb(&w->conf, mbedtls_ssl_ticket_write, rpc_ticket_parse, &srv->tickets);
+  } else {
+    mbedtls_ssl_conf_session_tickets(&w->conf, MBEDTLS_SSL_SESSION_TICKETS_DISABLED);
+  }
+#if RPC_KTLS_AVAILABLE
+  if (srv->config.ktls)
+    mbedtls_ssl_conf_export_keys_ext_cb(&w->conf, rpc_ktls_export_keys, w);
+#endif
+
+  mbedtls_ssl_conf_ca_chain(&w->conf, srv->cert.next, NULL);
+  s = mbedtls_ssl_conf_own_cert(&w->conf, &srv->cert, &srv->pk);
+  if (s != 0) {
+    perror("Failed to set up certificate");
+    return s;
+  }
+  return 0;
+}
+
+// Session cache entries, and whatever mbedtls allocates with RPC_TLS_MEM_HOOKS.
+// Global because mbedtls' allocator hooks don't take a context.
+global Mem_Accounting rpc_tls_mem;
+
+#if RPC_TLS_MEM_HOOKS
+// mbedtls doesn't tell free how large a block is, so that goes in front of it
+// (in 16 bytes, which keeps the block as aligned as malloc would).
+#define RPC_TLS_MEM_HEADER 16
+
+function void *
+rpc_tls_calloc(size_t n, size_t size) {
+  if (size != 0 && n > (SIZE_MAX - RPC_TLS_MEM_HEADER) / size) return NULL;
+  usize total = RPC_TLS_MEM_HEADER + n * size;
+  u8 *p = mem_reserve_commit(&rpc_tls_mem.base, total);
+  if (p == NULL) return NULL;
+  memset(p, 0, total);
+  memcpy(p, &total, sizeof(total));
+  return p + RPC_TLS_MEM_HEADER;
+}
+
+function void
+rpc_tls_free(void *p) {
+  if (p == NULL) return;
+  u8   *block = (u8 *)p - RPC_TLS_MEM_HEADER;
+  usize total;
+  memcpy(&total, block, sizeof(total));
+  mem_decommit_release(&rpc_tls_mem.base, block, total);
+}
+#endif
+
+function s32
+init_rpc_server(RpcServer *srv, RpcServerConfig config) {
+  srv->mb       = mem_malloc_base();
+  srv->objs     = mem_slab_base();
+  mem_accounting_init(&rpc_tls_mem, srv->mb, Mem_Tag_Tls);
+#if RPC_TLS_MEM_HOOKS
+  mbedtls_platform_set_calloc_free(rpc_tls_calloc, rpc_tls_free);
+#endif
+  config.scratch_reserve = ClampBot(config.scratch_reserve, RPC_SCRATCH_MIN_RESERVE);
+  config.scratch_warm    = ClampTop(config.scratch_warm, config.scratch_pool);
+  srv->config   = config;
+  srv->dispatch = (RpcDispatchTable){0};
+  rpc_dispatch_insert(srv->mb, &srv->dispatch, rpc_handler_new(RPC_PROC_PING, rpc_ping_handler, NULL));
+  rpc_dispatch_insert(srv->mb, &srv->dispatch, rpc_handler_new(RPC_PROC_METRICS, rpc_metrics_handler, NULL));
+  rpc_dispatch_insert(srv->mb, &srv->dispatch, rpc_handler_new(RPC_PROC_CANCEL, rpc_cancel_handler, NULL));
+  rpc_dispatch_insert(srv->mb, &srv->dispatch, rpc_handler_new(RPC_PROC_COMPRESSION, rpc_compression_handler, NULL));
+#if ENABLE_TRACE
+  rpc_dispatch_insert(srv->mb, &srv->dispatch, rpc_handler_new(RPC_PROC_TRACE, rpc_trace_handler, NULL));
+#endif
+
+  srv->n_workers = config.n_workers != 0 ? config.n_workers : os_cpu_count();
+  srv->n_workers = ClampTop(srv->n_workers, RPC_MAX_WORKERS);
+
   puts("Reading certificates");
 
   mbedtls_x509_crt_init(&srv->cert);
@@ -13,187 +159,2104 @@ init_rpc_server(RpcServer *srv) {
     return s;
   }
 
-  mbedtls_pk_init(&srv->pk);
-  s = mbedtls_pk_parse_keyfile(&srv->pk, "key.pem", "");
-  if (s != 0) {
-    perror("Failed to load key.pem");
-    return s;
+  mbedtls_pk_init(&srv->pk);
+  s = mbedtls_pk_parse_keyfile(&srv->pk, "key.pem", "");
+  if (s != 0) {
+    perror("Failed to load key.pem");
+    return s;
+  }
+
+  puts("Certificates read");
+
+  mbedtls_entropy_init(&srv->entropy);
+
+  if (config.session_cache_size > 0) {
+    s = rpc_session_cache_init(&srv->session_cache, &rpc_tls_mem.base, config.session_cache_size, config.session_timeout);
+    if (s != 0) {
+      perror("Failed to set up session cache");
+      return s;
+    }
+  }
+
+  mbedtls_ssl_ticket_init(&srv->tickets);
+  mbedtls_ctr_drbg_init(&srv->tickets_drbg);
+  if (config.session_tickets) {
+    // The ticket context locks around key rotation, which is the only time it uses the
+    // generator, so the generator can be shared by all workers.
+    const char *pers = "ssl_tickets";
+    s = mbedtls_ctr_drbg_seed(&srv->tickets_drbg, mbedtls_entropy_func, &srv->entropy, (const u8 *)pers, strlen(pers));
+    if (s != 0) {
+      printf("Failed to seed ticket key generator: -0x%x\n", (u32)-s);
+      return s;
+    }
+    s = mbedtls_ssl_ticket_setup(&srv->tickets, mbedtls_ctr_drbg_random, &srv->tickets_drbg,
+                                 MBEDTLS_CIPHER_AES_256_GCM, config.session_timeout);
+    if (s != 0) {
+      printf("Failed to set up session tickets: -0x%x\n", (u32)-s);
+      return s;
+    }
+  }
+
+  srv->workers = mem_reserve_commit(srv->mb, srv->n_workers * sizeof(RpcWorker));
+  for (usize i = 0; i < srv->n_workers; i++) {
+    s = rpc_worker_init(srv, &srv->workers[i], i);
+    if (s != 0) return s;
+  }
+
+  srv->pool = (RpcHandlerPool){0};
+  if (config.n_handler_threads > 0) return rpc_handler_pool_init(srv, config.n_handler_threads);
+  return 0;
+}
+
+// The threads are spawned by run_rpc_server.
+function s32
+rpc_handler_pool_init(RpcServer *srv, usize n_threads) {
+  srv->pool.n_threads = n_threads;
+  mpmc_init(&srv->pool.queue, srv->mb, slice_next_cap(ClampBot(srv->config.handler_queue_size, 2)));
+  s32 s = semaphore_init(&srv->pool.ready, 0);
+  if (s != 0) {
+    perror("Failed to create handler pool semaphore");
+    return s;
+  }
+  srv->pool.threads = mem_reserve_commit(srv->mb, n_threads * sizeof(Thread));
+  return 0;
+}
+
+// Only valid on the thread of the worker owning the client.
+function RpcClient *
+rpc_server_client(RpcServer *srv, u64 id) {
+  usize wi = RpcClientIdWorker(id);
+  if (wi >= srv->n_workers) return NULL;
+  RpcWorker *w = &srv->workers[wi];
+  usize slot = RpcClientIdSlot(id);
+  if (slot >= SliceLen(w->clients)) return NULL;
+  RpcClient *c = w->clients.items[slot];
+  if (c == NULL || c->id != id) return NULL;
+  return c;
+}
+
+function void *
+rpc_buf_pool_reserve(void *ctx, usize size) {
+  RpcBufPool *p = ctx;
+  __atomic_fetch_add(p->used, size, __ATOMIC_RELAXED);
+  return mem_reserve(p->backing, size);
+}
+
+function void
+rpc_buf_pool_commit(void *ctx, void *ptr, usize size) {
+  RpcBufPool *p = ctx;
+  mem_commit(p->backing, ptr, size);
+}
+
+function void
+rpc_buf_pool_decommit(void *ctx, void *ptr, usize size) {
+  RpcBufPool *p = ctx;
+  mem_decommit(p->backing, ptr, size);
+}
+
+function void
+rpc_buf_pool_release_mem(void *ctx, void *ptr, usize size) {
+  RpcBufPool *p = ctx;
+  mem_release(p->backing, ptr, size);
+  __atomic_fetch_sub(p->used, size, __ATOMIC_RELAXED);
+}
+
+// p must not move afterwards, its mb points back at it.
+function void
+rpc_buf_pool_init(RpcBufPool *p, Mem_Base *backing, usize *used, usize max_free) {
+  *p = (RpcBufPool){ .backing = backing, .used = used, .max_free = max_free };
+  p->mb = (Mem_Base){
+    .reserve  = rpc_buf_pool_reserve,
+    .commit   = rpc_buf_pool_commit,
+    .decommit = rpc_buf_pool_decommit,
+    .release  = rpc_buf_pool_release_mem,
+    .ctx      = p,
+  };
+}
+
+// Gives an empty buffer a chunk to write into. buf must not have any memory yet.
+function void
+rpc_buf_pool_acquire(RpcBufPool *p, Slice(u8) *buf) {
+  Assert(buf->items == NULL && buf->mb == &p->mb);
+  RpcBufChunk *chunk = p->free;
+  if (chunk != NULL) {
+    p->free = chunk->next;
+    p->n_free--;
+    __atomic_fetch_add(p->used, RPC_BUF_CHUNK, __ATOMIC_RELAXED);
+    RpcStatInc(p->stats.hits);
+  } else {
+    chunk = mem_reserve_commit(&p->mb, RPC_BUF_CHUNK);
+    RpcStatInc(p->stats.misses);
+  }
+  buf->items = (u8 *)chunk;
+  buf->cap   = RPC_BUF_CHUNK;
+  buf->len   = 0;
+}
+
+// Takes back the memory of a buffer acquired from (and allocated through) p, or of a
+// reserved one (mb is its own) grown through rpc_buf_reserve.
+function void
+rpc_buf_pool_release(RpcBufPool *p, Mem_Base *mb, u8 *items, usize cap) {
+  if (mb != &p->mb) {
+    slice_destroy(cap, mb, items, sizeof(u8));
+    __atomic_fetch_sub(p->used, cap, __ATOMIC_RELAXED);
+    return;
+  }
+  if (items == NULL) return;
+  if (cap != RPC_BUF_CHUNK) {
+    slice_destroy(cap, &p->mb, items, sizeof(u8));
+  } else if (p->n_free < p->max_free) {
+    RpcBufChunk *chunk = (RpcBufChunk *)(void *)items;
+    chunk->next = p->free;
+    p->free     = chunk;
+    p->n_free++;
+    __atomic_fetch_sub(p->used, RPC_BUF_CHUNK, __ATOMIC_RELAXED);
+    RpcStatInc(p->stats.returns);
+  } else {
+    mem_decommit_release(&p->mb, items, RPC_BUF_CHUNK);
+    RpcStatInc(p->stats.drops);
+  }
+}
+
+// Makes room for n more bytes at the end of buf, which has memory from p or none yet,
+// or is a reserved slice (SliceNewReserved) whose memory p only counts.
+// Growing through SliceReserve would hand a chunk straight back to the backing base,
+// so a buffer outgrowing its chunk is moved to memory of its own by hand and the
+// chunk goes back to the free list.
+function void
+rpc_buf_reserve(RpcBufPool *p, Slice(u8) *buf, usize n) {
+  if (buf->mb != &p->mb) {
+    usize cap = buf->cap;
+    SliceReserve(buf, n);
+    __atomic_fetch_add(p->used, buf->cap - cap, __ATOMIC_RELAXED);
+    return;
+  }
+  if (buf->items == NULL && n <= RPC_BUF_CHUNK) rpc_buf_pool_acquire(p, buf);
+  if (SliceSpare(*buf) >= n) return;
+  if (buf->cap != RPC_BUF_CHUNK) {
+    SliceReserve(buf, n);
+    return;
+  }
+  usize cap = slice_next_cap(SliceLen(*buf) + n);
+  u8 *items = mem_reserve_commit(&p->mb, cap);
+  memcpy(items, buf->items, SliceLen(*buf));
+  rpc_buf_pool_release(p, buf->mb, buf->items, buf->cap);
+  buf->items = items;
+  buf->cap   = cap;
+}
+
+// Sums the pool stats of all workers. May be called from any thread.
+function RpcBufPoolStats
+rpc_server_buf_pool_stats(RpcServer *srv) {
+  RpcBufPoolStats total = {0};
+  for (usize i = 0; i < srv->n_workers; i++) {
+    RpcBufPoolStats *st = &srv->workers[i].bufs.stats;
+    total.hits    += __atomic_load_n(&st->hits,    __ATOMIC_RELAXED);
+    total.misses  += __atomic_load_n(&st->misses,  __ATOMIC_RELAXED);
+    total.returns += __atomic_load_n(&st->returns, __ATOMIC_RELAXED);
+    total.drops   += __atomic_load_n(&st->drops,   __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+// Bytes held by connection buffers in use right now. May be called from any thread.
+function usize
+rpc_server_buffer_memory(RpcServer *srv) {
+  return __atomic_load_n(&srv->buffer_memory, __ATOMIC_RELAXED);
+}
+
+// Sums the TLS stats of all workers. May be called from any thread.
+function RpcTlsStats
+rpc_server_tls_stats(RpcServer *srv) {
+  RpcTlsStats total = {0};
+  for (usize i = 0; i < srv->n_workers; i++) {
+    RpcTlsStats *st = &srv->workers[i].tls_stats;
+    total.handshakes    += __atomic_load_n(&st->handshakes,    __ATOMIC_RELAXED);
+    total.cache_hits    += __atomic_load_n(&st->cache_hits,    __ATOMIC_RELAXED);
+    total.cache_misses  += __atomic_load_n(&st->cache_misses,  __ATOMIC_RELAXED);
+    total.ticket_hits   += __atomic_load_n(&st->ticket_hits,   __ATOMIC_RELAXED);
+    total.ticket_misses += __atomic_load_n(&st->ticket_misses, __ATOMIC_RELAXED);
+    total.ktls_offloads += __atomic_load_n(&st->ktls_offloads, __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+// Sums the reaping stats of all workers. May be called from any thread.
+function RpcReapStats
+rpc_server_reap_stats(RpcServer *srv) {
+  RpcReapStats total = {0};
+  for (usize i = 0; i < srv->n_workers; i++) {
+    RpcReapStats *st = &srv->workers[i].reap_stats;
+    total.idle       += __atomic_load_n(&st->idle,       __ATOMIC_RELAXED);
+    total.handshakes += __atomic_load_n(&st->handshakes, __ATOMIC_RELAXED);
+    total.bytes      += __atomic_load_n(&st->bytes,      __ATOMIC_RELAXED);
+  }
+  return total;
+}
+
+function void
+rpc_client_release_buf(RpcClient *c, Slice(u8) *buf) {
+  rpc_buf_pool_release(&c->worker->bufs, buf->mb, buf->items, buf->cap);
+  *buf = SliceNew(u8, &c->worker->bufs.mb);
+}
+
+#if RPC_KTLS_AVAILABLE
+// mbedtls_ssl_conf_export_keys_ext_cb callback. Called in the middle of a handshake
+// step, so the keys are staged on the worker for the client whose step it is.
+function int
+rpc_ktls_export_keys(void *ctx, const unsigned char *ms, const unsigned char *kb,
+                     size_t maclen, size_t keylen, size_t ivlen,
+                     const unsigned char client_random[32], const unsigned char server_random[32],
+                     mbedtls_tls_prf_types tls_prf_type) {
+  (void)ms; (void)client_random; (void)server_random; (void)tls_prf_type;
+  RpcWorker *w = ctx;
+  // AEAD suites have no MAC keys and a 4 byte implicit nonce (the salt). Whether
+  // the cipher is actually AES-GCM is checked once the handshake is done.
+  if (maclen != 0 || (keylen != 16 && keylen != 32) || ivlen != 4) return 0;
+  // The key block holds: client MAC, server MAC, client key, server key, client IV, server IV.
+  RpcKtlsKeys *k = &w->ktls_staged;
+  k->key_len = keylen;
+  memcpy(k->client_key,  kb,                      keylen);
+  memcpy(k->server_key,  kb + keylen,             keylen);
+  memcpy(k->client_salt, kb + 2 * keylen,         ivlen);
+  memcpy(k->server_salt, kb + 2 * keylen + ivlen, ivlen);
+  w->ktls_staged_ready = true;
+  return 0;
+}
+
+function bool
+rpc_ktls_install(int fd, int direction, usize key_len, const u8 *key, const u8 *salt) {
+  // Both sides sent exactly one record since ChangeCipherSpec reset the sequence
+  // numbers: their Finished message. (Renegotiation is disabled, nothing else is sent.)
+  u8 seq[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+  bool ok;
+  if (key_len == 16) {
+    struct tls12_crypto_info_aes_gcm_128 info = {
+      .info = { .version = TLS_1_2_VERSION, .cipher_type = TLS_CIPHER_AES_GCM_128 },
+    };
+    memcpy(info.key,     key,  sizeof(info.key));
+    memcpy(info.salt,    salt, sizeof(info.salt));
+    memcpy(info.iv,      seq,  sizeof(info.iv)); // explicit nonce, the sequence number like mbedtls
+    memcpy(info.rec_seq, seq,  sizeof(info.rec_seq));
+    ok = setsockopt(fd, SOL_TLS, direction, &info, sizeof(info)) == 0;
+    mbedtls_platform_zeroize(&info, sizeof(info));
+  } else {
+    struct tls12_crypto_info_aes_gcm_256 info = {
+      .info = { .version = TLS_1_2_VERSION, .cipher_type = TLS_CIPHER_AES_GCM_256 },
+    };
+    memcpy(info.key,     key,  sizeof(info.key));
+    memcpy(info.salt,    salt, sizeof(info.salt));
+    memcpy(info.iv,      seq,  sizeof(info.iv));
+    memcpy(info.rec_seq, seq,  sizeof(info.rec_seq));
+    ok = setsockopt(fd, SOL_TLS, direction, &info, sizeof(info)) == 0;
+    mbedtls_platform_zeroize(&info, sizeof(info));
+  }
+  return ok;
+}
+
+// Sends a close_notify alert through the kernel record layer.
+function void
+rpc_ktls_close_notify(int fd) {
+  u8 alert[2] = { 1 /* warning */, 0 /* close_notify */ };
+  u8 cbuf[CMSG_SPACE(sizeof(u8))] = {0};
+  struct iovec  iov = { .iov_base = alert, .iov_len = sizeof(alert) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_TLS;
+  cm->cmsg_type  = TLS_SET_RECORD_TYPE;
+  cm->cmsg_len   = CMSG_LEN(sizeof(u8));
+  *CMSG_DATA(cm) = RPC_TLS_RECORD_ALERT;
+  sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// Reads plaintext from a kTLS socket. Results follow mbedtls_ssl_read.
+function s32
+rpc_ktls_recv(int fd, u8 *buf, usize len) {
+  u8 cbuf[CMSG_SPACE(sizeof(u8))];
+  struct iovec  iov = { .iov_base = buf, .iov_len = Min(len, RPC_KTLS_MAX_IO) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+  ssize_t n;
+  do n = recvmsg(fd, &msg, 0); while (n == -1 && errno == EINTR);
+  if (n == -1) {
+    if (errno == EAGAIN) return MBEDTLS_ERR_SSL_WANT_READ;
+    if (errno == ECONNRESET) return MBEDTLS_ERR_NET_CONN_RESET;
+    return MBEDTLS_ERR_NET_RECV_FAILED;
+  }
+  // Records other than application data are returned one at a time, tagged with their type.
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  if (cm != NULL && cm->cmsg_level == SOL_TLS && cm->cmsg_type == TLS_GET_RECORD_TYPE) {
+    u8 type = *CMSG_DATA(cm);
+    if (type != RPC_TLS_RECORD_APPLICATION_DATA) {
+      if (type == RPC_TLS_RECORD_ALERT && n == 2 && buf[1] == 0) return MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY;
+      return MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE;
+    }
+  }
+  return (s32)n;
+}
+
+// Writes plaintext to a kTLS socket. Results follow mbedtls_ssl_write.
+function s32
+rpc_ktls_send(int fd, const u8 *buf, usize len) {
+  ssize_t n;
+  do n = send(fd, buf, Min(len, RPC_KTLS_MAX_IO), MSG_NOSIGNAL); while (n == -1 && errno == EINTR);
+  if (n >= 0) return (s32)n;
+  if (errno == EAGAIN) return MBEDTLS_ERR_SSL_WANT_WRITE;
+  if (errno == ECONNRESET || errno == EPIPE) return MBEDTLS_ERR_NET_CONN_RESET;
+  return MBEDTLS_ERR_NET_SEND_FAILED;
+}
+#endif
+
+function void
+rpc_client_drop_ktls_keys(RpcClient *c) {
+  if (c->ktls_keys == NULL) return;
+  mbedtls_platform_zeroize(c->ktls_keys, sizeof(RpcKtlsKeys));
+  mem_decommit_release(c->worker->mb, c->ktls_keys, sizeof(RpcKtlsKeys));
+  c->ktls_keys = NULL;
+}
+
+// Takes the keys mbedtls exported during the handshake step just taken on c, if any.
+function void
+rpc_client_claim_ktls_keys(RpcClient *c) {
+  RpcWorker *w = c->worker;
+  if (!w->ktls_staged_ready) return;
+  if (c->ktls_keys == NULL) c->ktls_keys = mem_reserve_commit(w->mb, sizeof(RpcKtlsKeys));
+  *c->ktls_keys = w->ktls_staged;
+  mbedtls_platform_zeroize(&w->ktls_staged, sizeof(RpcKtlsKeys));
+  w->ktls_staged_ready = false;
+}
+
+// Moves the record layer of a freshly established connection into the kernel.
+// Each direction the kernel refuses (no tls module, unsupported cipher) simply stays
+// with mbedtls, so this never fails the connection.
+function void
+rpc_client_enable_ktls(RpcClient *c) {
+#if RPC_KTLS_AVAILABLE
+  RpcKtlsKeys *k = c->ktls_keys;
+  if (k == NULL) return;
+  const char *name = mbedtls_ssl_get_ciphersuite(&c->ssl);
+  const mbedtls_ssl_ciphersuite_t *cs = name != NULL ? mbedtls_ssl_ciphersuite_from_id(mbedtls_ssl_get_ciphersuite_id(name)) : NULL;
+  // GCM suites only exist in TLS 1.2, so the version needn't be checked separately.
+  bool ok = cs != NULL && ((cs->cipher == MBEDTLS_CIPHER_AES_128_GCM && k->key_len == 16) ||
+                           (cs->cipher == MBEDTLS_CIPHER_AES_256_GCM && k->key_len == 32));
+  // Input mbedtls already took off the socket would never reach the kernel.
+  ok = ok && !mbedtls_ssl_check_pending(&c->ssl) && mbedtls_ssl_get_bytes_avail(&c->ssl) == 0;
+  if (ok && setsockopt(c->fd.fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0) {
+    c->ktls_tx = rpc_ktls_install(c->fd.fd, TLS_TX, k->key_len, k->server_key, k->server_salt);
+    c->ktls_rx = rpc_ktls_install(c->fd.fd, TLS_RX, k->key_len, k->client_key, k->client_salt);
+  }
+  if (c->ktls_tx || c->ktls_rx) RpcStatInc(c->worker->tls_stats.ktls_offloads);
+#endif
+  rpc_client_drop_ktls_keys(c);
+}
+
+function void
+rpc_client_close_notify(RpcClient *c) {
+#if RPC_KTLS_AVAILABLE
+  if (c->ktls_tx) {
+    rpc_ktls_close_notify(c->fd.fd);
+    return;
+  }
+#endif
+  mbedtls_ssl_close_notify(&c->ssl);
+}
+
+function s32
+rpc_client_recv(RpcClient *c, u8 *buf, usize len) {
+#if RPC_KTLS_AVAILABLE
+  if (c->ktls_rx) return rpc_ktls_recv(c->fd.fd, buf, len);
+#endif
+  return mbedtls_ssl_read(&c->ssl, buf, len);
+}
+
+function s32
+rpc_client_send(RpcClient *c, const u8 *buf, usize len) {
+#if RPC_KTLS_AVAILABLE
+  if (c->ktls_tx) return rpc_ktls_send(c->fd.fd, buf, len);
+#endif
+  return mbedtls_ssl_write(&c->ssl, buf, len);
+}
+
+// Wakes the handler thread of job if it's blocked in rpc_server_stream.
+function void
+rpc_job_stream_wake(RpcJob *job) {
+  if (__atomic_exchange_n(&job->stream_waiting, 0, __ATOMIC_SEQ_CST) != 0)
+    semaphore_post(&job->stream_room);
+}
+
+// Gives the handler of job room for n more bytes of stream chunks.
+function void
+rpc_job_stream_credit(RpcJob *job, usize n) {
+  __atomic_sub_fetch(&job->stream_queued, n, __ATOMIC_SEQ_CST);
+  rpc_job_stream_wake(job);
+}
+
+function void
+rpc_job_stream_unlink(RpcJob *job) {
+  if (job->stream_pprev == NULL) return;
+  *job->stream_pprev = job->stream_next;
+  if (job->stream_next != NULL) job->stream_next->stream_pprev = job->stream_pprev;
+  job->stream_next  = NULL;
+  job->stream_pprev = NULL;
+}
+
+// Credits the jobs whose stream chunks in wbuf have all been written out.
+function void
+rpc_client_credit_streams(RpcClient *c) {
+  RpcJob *job = c->streams;
+  while (job != NULL) {
+    RpcJob *next = job->stream_next;
+    if (SliceLen(c->wbuf) == 0 || job->stream_end <= c->wbufi) {
+      rpc_job_stream_unlink(job);
+      rpc_job_stream_credit(job, job->stream_unsent);
+      job->stream_unsent = 0;
+    }
+    job = next;
+  }
+}
+
+function void
+rpc_client_close(RpcClient *c) {
+  RpcWorker *w = c->worker;
+  timer_cancel(&w->timers, &c->idle);
+  // Handlers still streaming to c have nobody to stream to any more.
+  while (c->streams != NULL) {
+    RpcJob *job = c->streams;
+    rpc_job_stream_unlink(job);
+    __atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+    rpc_job_stream_credit(job, job->stream_unsent);
+    job->stream_unsent = 0;
+  }
+  if (c->state == RpcClientState_Open)
+    rpc_client_close_notify(c); // best effort, the socket is non-blocking
+  rpc_client_drop_ktls_keys(c);
+  // Closing the descriptor also removes it from the epoll interest list.
+  mbedtls_net_free(&c->fd);
+  mbedtls_ssl_free(&c->ssl);
+  if (c->rbuf_ref != NULL) c->rbuf_ref->retired = true; // released by the last handler using it
+  else                     rpc_client_release_buf(c, &c->rbuf);
+  rpc_client_release_buf(c, &c->wbuf);
+  rpc_inflight_destroy(w->mb, &c->inflight);
+
+  usize slot = RpcClientIdSlot(c->id);
+  w->clients.items[slot] = NULL;
+  SliceAppend(&w->free_slots, slot);
+  mem_decommit_release(w->mb, c, sizeof(RpcClient));
+}
+
+// Roughly what a connection costs while it's open. mbedtls allocates a record buffer
+// for each direction, holding a record of up to MBEDTLS_SSL_MAX_CONTENT_LEN plus headers.
+function usize
+rpc_client_footprint(RpcClient *c) {
+  usize n = sizeof(RpcClient) + 2 * MBEDTLS_SSL_MAX_CONTENT_LEN;
+  n += c->rbuf_ref == NULL ? c->rbuf.cap : 0; // a pinned rbuf outlives the client anyway
+  n += c->wbuf.cap;
+  if (c->inflight.entries != NULL) n += sizeof(RpcInflight) << c->inflight.shift;
+  return n;
+}
+
+// Runs when the idle timer of a client goes off. Timers are only re-armed here, so
+// keeping track of activity costs a store per read and no timer work at all.
+function void
+rpc_client_idle_check(Timer *t, void *ctx) {
+  RpcClient *c   = ctx;
+  RpcWorker *w   = c->worker;
+  RpcServerConfig *cfg = &c->server->config;
+  u64 now = t->expires;
+
+  if (c->state == RpcClientState_Handshake) {
+    puts("Handshake timed out, closing connection");
+    RpcStatInc(w->reap_stats.handshakes);
+  } else {
+    // Handlers still working on its requests count as activity, a stalled peer doesn't.
+    bool busy = c->inflight.len > 0 || c->job_bytes > 0;
+    u64  due  = c->rtime + cfg->idle_timeout_ms;
+    if (busy || due > now) {
+      timer_arm(&w->timers, &c->idle, busy ? now + cfg->idle_timeout_ms : due, rpc_client_idle_check, c);
+      return;
+    }
+    puts("Connection went idle, closing it");
+    RpcStatInc(w->reap_stats.idle);
+  }
+  __atomic_store_n(&w->reap_stats.bytes, w->reap_stats.bytes + rpc_client_footprint(c), __ATOMIC_RELAXED);
+  rpc_client_close(c);
+}
+
+// Built-in procedure 0, answers VoidResponse.ok. Keeps the connection from being reaped.
+// Unless replaced, pings never get here: see rpc_client_answer_ping.
+function void
+rpc_ping_handler(RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx) {
+  (void)scratch; (void)ctx;
+  rpc_server_respond_status(srv, &req, RpcStatus_Ok);
+}
+
+// Built-in procedure 3: the payload is the response ID (vu64) of a request of the same
+// client. A request still waiting for a handler thread is answered with Cancelled and
+// never runs; one that is running gets its cancelled flag set. Answers Ok if the request
+// was in flight and NotFound if not. Always runs on the I/O thread of the client,
+// as it works on the inflight table.
+function void
+rpc_cancel_handler(RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx) {
+  (void)scratch; (void)ctx;
+  u64   id = 0;
+  u8    n  = 0;
+  usize consumed;
+  if (try_read_vu64(req.data, &id, &n, &consumed) != RpcDecodeStatus_Done || consumed != req.data.len || id == 0) {
+    rpc_server_respond_status(srv, &req, RpcStatus_InvalidArgument);
+    return;
+  }
+  RpcClient   *c = rpc_server_client(srv, req.client_id);
+  RpcInflight *e = c != NULL ? rpc_inflight_find(&c->inflight, id) : NULL;
+  if (e == NULL) {
+    rpc_server_respond_status(srv, &req, RpcStatus_NotFound);
+    return;
+  }
+  RpcJob *job = e->job;
+  if (job != NULL) {
+    u32 queued = RpcJobState_Queued;
+    if (__atomic_compare_exchange_n(&job->state, &queued, RpcJobState_Cancelled, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      timer_cancel(&c->worker->timers, &job->deadline);
+      rpc_server_respond_status(srv, &job->req, RpcStatus_Cancelled);
+    } else {
+      __atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+      rpc_job_stream_wake(job);
+    }
+  }
+  rpc_server_respond_status(srv, &req, RpcStatus_Ok);
+}
+
+// Built-in procedure 4: the payload is a vu64 with the bit of every RPC_COMPRESSION_* codec
+// the client can decompress. Answers Ok with the codec the server picked (vu64, 0 for none).
+// From then on, responses of at least compress_min_size bytes may come compressed with it.
+// Always runs on the I/O thread of the client, as it sets RpcClient.compress.
+function void
+rpc_compression_handler(RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx) {
+  (void)ctx;
+  u64   codecs = 0;
+  u8    n      = 0;
+  usize consumed;
+  if (try_read_vu64(req.data, &codecs, &n, &consumed) != RpcDecodeStatus_Done || consumed != req.data.len) {
+    rpc_server_respond_status(srv, &req, RpcStatus_InvalidArgument);
+    return;
+  }
+  u64 codec = srv->config.compress_min_size != 0 && (codecs & RPC_COMPRESSION_LZ) ? RPC_COMPRESSION_LZ : 0;
+  RpcClient *c = rpc_server_client(srv, req.client_id);
+  if (c != NULL) c->compress = codec != 0;
+  RpcResponse rsp = {
+    .client_id  = req.client_id,
+    .request_id = req.request_id,
+    .code       = RpcStatus_Ok,
+    .family     = RpcFamilyStatus(RpcStatus_Ok),
+    .data       = SliceNew(u8, &scratch->base),
+  };
+  SliceReserve(&rsp.data, RPC_VU64_MAX_LEN);
+  rsp.data.len = write_vu64(rsp.data.items, codec);
+  rpc_server_respond(srv, rsp);
+}
+
+function void
+rpc_client_report_error(const char *what, s32 s) {
+  switch (s) {
+  case MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY:
+    puts("Connection was closed gracefully");
+    break;
+  case MBEDTLS_ERR_NET_CONN_RESET:
+    puts("Connection was reset by peer");
+    break;
+  default:
+    printf("Error: %s returned -0x%x\n", what, (u32)-s);
+    break;
+  }
+}
+
+// Writes out as much of wbuf as the socket accepts.
+// Returns false if the connection broke and the client was closed.
+function bool
+rpc_client_flush(RpcClient *c) {
+  // Everything queued is written in records as large as mbedtls allows,
+  // instead of paying a record header and a syscall per response.
+  // With kTLS the kernel cuts records itself, so everything goes out in one send.
+  s32 max_record = mbedtls_ssl_get_max_out_record_payload(&c->ssl);
+  usize record_len = c->ktls_tx   ? RPC_KTLS_MAX_IO
+                   : max_record > 0 ? (usize)max_record : MBEDTLS_SSL_MAX_CONTENT_LEN;
+  while (c->wbufi < SliceLen(c->wbuf)) {
+    usize n = c->wretry != 0 ? c->wretry : Min(SliceLen(c->wbuf) - c->wbufi, record_len);
+    TraceBegin("write", c->id);
+    s32 s = rpc_client_send(c, c->wbuf.items + c->wbufi, n);
+    TraceEnd("write", c->id);
+    if (s == MBEDTLS_ERR_SSL_WANT_READ || s == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      // We'll get an EPOLLOUT edge once the socket is writable again.
+      c->wretry = n;
+      if (c->streams != NULL) rpc_client_credit_streams(c);
+      return true;
+    }
+    if (s < 0) {
+      rpc_client_report_error(c->ktls_tx ? "send" : "mbedtls_ssl_write", s);
+      rpc_client_close(c);
+      return false;
+    }
+    c->wretry = 0;
+    c->wbufi += (usize)s;
+  }
+  // Everything went out, the buffer isn't needed until the next response.
+  rpc_client_release_buf(c, &c->wbuf);
+  c->wbufi = 0;
+  if (c->streams != NULL) rpc_client_credit_streams(c);
+  return true;
+}
+
+function bool
+rpc_client_rbuf_pinned(RpcClient *c) {
+  return c->rbuf_ref != NULL && c->rbuf_ref->pins > 0;
+}
+
+// A receive buffer with room for n bytes. One that won't fit in a chunk goes in address
+// space reserved for the largest frame (if it can be had), where it grows in place.
+function Slice(u8)
+rpc_client_new_rbuf(RpcClient *c, usize n) {
+  RpcBufPool *p = &c->worker->bufs;
+  Slice(u8) buf = SliceNew(u8, &p->mb);
+  if (n > RPC_BUF_CHUNK && n <= RPC_RBUF_MAX) {
+    Slice(u8) reserved = SliceNewReserved(u8, RPC_RBUF_MAX, Mem_Tag_ClientBuffers);
+    if (reserved.mb != NULL) buf = reserved;
+  }
+  rpc_buf_reserve(p, &buf, n);
+  return buf;
+}
+
+// Makes sure there's room for n more bytes at the end of rbuf. Only the incomplete
+// frame at the tail (if any) is ever moved. A frame outgrowing a chunk moves to a
+// reserved rbuf, so the rest of it (however big) is read without any more copies.
+// If handler threads are still reading payloads from rbuf, a reserved one grows in
+// place; any other is retired and the tail moves to a fresh buffer instead.
+function void
+rpc_client_rbuf_reserve(RpcClient *c, usize n) {
+  RpcBufPool *p = &c->worker->bufs;
+  if (SliceSpare(c->rbuf) >= n) return;
+  usize tail     = SliceLen(c->rbuf) - c->rstart;
+  bool  pinned   = rpc_client_rbuf_pinned(c);
+  bool  reserved = c->rbuf.mb != &p->mb;
+  if (pinned && reserved && SliceLen(c->rbuf) + n <= RPC_RBUF_MAX) {
+    rpc_buf_reserve(p, &c->rbuf, n);
+    c->rbuf_ref->cap = c->rbuf.cap;
+    return;
+  }
+  bool outgrown = reserved ? tail + n > RPC_RBUF_MAX
+                           : tail + n > RPC_BUF_CHUNK && c->rbuf.cap <= RPC_BUF_CHUNK;
+  if (pinned || outgrown) {
+    Slice(u8) fresh = rpc_client_new_rbuf(c, tail + n);
+    memcpy(fresh.items, c->rbuf.items + c->rstart, tail);
+    fresh.len = tail;
+    if (pinned) {
+      c->rbuf_ref->retired = true;
+      c->rbuf_ref = NULL;
+    } else {
+      rpc_client_release_buf(c, &c->rbuf);
+    }
+    c->rbuf = fresh;
+  } else if (c->rstart > 0) {
+    memmove(c->rbuf.items, c->rbuf.items + c->rstart, tail);
+    c->rbuf.len = tail;
+  }
+  c->rpos  -= c->rstart;
+  c->rstart = 0;
+  rpc_buf_reserve(p, &c->rbuf, n);
+}
+
+// Reads until mbedtls runs out of (buffered or socket) data, straight into
+// the spare capacity of rbuf. Returns false if the client was closed.
+function bool
+rpc_client_on_readable(RpcClient *c) {
+  while (true) {
+    if (rpc_client_throttle(c)) return true;
+    rpc_client_rbuf_reserve(c, RPC_READ_CHUNK);
+    TraceBegin("read", c->id);
+    s32 s = rpc_client_recv(c, c->rbuf.items + c->rbuf.len, SliceSpare(c->rbuf));
+    TraceEnd("read", c->id);
+    if (s == MBEDTLS_ERR_SSL_WANT_READ || s == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      // Out of data. Unless a frame is still incomplete, rbuf can go back to the pool.
+      if (SliceLen(c->rbuf) == 0 && c->rbuf_ref == NULL) rpc_client_release_buf(c, &c->rbuf);
+      return true;
+    }
+    if (s <= 0) {
+      if (s == 0) s = MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY; // EOF
+      rpc_client_report_error(c->ktls_rx ? "recvmsg" : "mbedtls_ssl_read", s);
+      rpc_client_close(c);
+      return false;
+    }
+    c->rbuf.len += (usize)s;
+    c->rtime     = os_now_ms();
+    if (!rpc_client_read(c)) return false;
+  }
+}
+
+function bool
+rpc_client_over_memory_cap(RpcServer *srv) {
+  return srv->config.max_buffer_memory != 0 &&
+         rpc_server_buffer_memory(srv) >= srv->config.max_buffer_memory;
+}
+
+// What a client has the server hold on to that will go away without reading more from it.
+function usize
+rpc_client_backlog(RpcClient *c) {
+  return SliceLen(c->wbuf) - c->wbufi + c->job_bytes;
+}
+
+// Pauses c if its backlog exceeds its high watermark, or if the server is
+// over its buffer memory cap. A paused client isn't read from and its buffered requests
+// aren't dispatched, so it can't make the server hold any more responses for it.
+// Returns whether c is paused.
+function bool
+rpc_client_throttle(RpcClient *c) {
+  if (c->paused) return true;
+  RpcServer *srv = c->server;
+  usize high = srv->config.client_high_watermark;
+  if (!((high != 0 && rpc_client_backlog(c) >= high) || rpc_client_over_memory_cap(srv))) return false;
+  c->paused = true;
+  SliceAppend(&c->worker->paused, c->id);
+  return true;
+}
+
+// Resumes paused clients whose backlog has drained to the low watermark, as long as the
+// server is under its memory cap. Their buffered requests are dispatched and reading
+// continues where it stopped (no new edge will come for data that's already there).
+function void
+rpc_worker_resume_paused(RpcWorker *w) {
+  RpcServer *srv = w->server;
+  usize n = SliceLen(w->paused), kept = 0;
+  for (usize i = 0; i < n; i++) {
+    u64 id = w->paused.items[i];
+    RpcClient *c = rpc_server_client(srv, id);
+    if (c == NULL) continue; // closed in the meantime
+    if (rpc_client_backlog(c) > srv->config.client_low_watermark || rpc_client_over_memory_cap(srv)) {
+      w->paused.items[kept++] = id;
+      continue;
+    }
+    c->paused = false;
+    if (rpc_client_read(c)) rpc_client_on_readable(c);
+  }
+  // Clients that paused (again) while resuming the others were appended after the first n.
+  usize added = SliceLen(w->paused) - n;
+  memmove(w->paused.items + kept, w->paused.items + n, added * sizeof(u64));
+  w->paused.len = kept + added;
+}
+
+function void
+rpc_client_queue_flush(RpcClient *c) {
+  if (c->dirty) return;
+  c->dirty = true;
+  SliceAppend(&c->worker->dirty, c->id);
+}
+
+function void
+rpc_worker_flush_dirty(RpcWorker *w) {
+  for (usize i = 0; i < SliceLen(w->dirty); i++) {
+    // Clients may have been closed since they were queued.
+    RpcClient *c = rpc_server_client(w->server, w->dirty.items[i]);
+    if (c == NULL) continue;
+    c->dirty = false;
+    rpc_client_flush(c);
+  }
+  w->dirty.len = 0;
+}
+
+function void
+rpc_client_on_event(RpcClient *c, u32 events) {
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    puts("Connection was reset by peer");
+    rpc_client_close(c);
+    return;
+  }
+
+  if (c->state == RpcClientState_Handshake) {
+    TraceBegin("handshake", c->id);
+    s32 s = mbedtls_ssl_handshake(&c->ssl);
+    rpc_client_claim_ktls_keys(c);
+    TraceEnd("handshake", c->id);
+    if (s == MBEDTLS_ERR_SSL_WANT_READ || s == MBEDTLS_ERR_SSL_WANT_WRITE)
+      return;
+    if (s != 0) {
+      printf("SSL handshake failed: -0x%x\n", (u32)-s);
+      rpc_client_close(c);
+      return;
+    }
+    puts("Handshake succeeded");
+    RpcStatInc(c->worker->tls_stats.handshakes);
+    c->state = RpcClientState_Open;
+    // From now on it's the idle timeout that applies.
+    timer_cancel(&c->worker->timers, &c->idle);
+    c->rtime = os_now_ms();
+    if (c->server->config.idle_timeout_ms != 0)
+      timer_arm(&c->worker->timers, &c->idle, c->rtime + c->server->config.idle_timeout_ms, rpc_client_idle_check, c);
+    if (c->server->config.ktls) rpc_client_enable_ktls(c);
+    // The client may have sent its first request along with the last handshake message,
+    // so fall through and read regardless of which event woke us up.
+    events |= EPOLLIN;
+  }
+
+  if (events & EPOLLIN) {
+    if (!rpc_client_on_readable(c)) return;
+  }
+  // Edge-triggered: whatever woke us up, try to make progress on pending output.
+  if (c->wbufi < SliceLen(c->wbuf)) rpc_client_queue_flush(c);
+}
+
+// Accepts one connection. Returns false once the backlog is drained (or accept fails).
+function bool
+rpc_worker_accept_one(RpcWorker *w) {
+  mbedtls_net_context client_fd;
+  mbedtls_net_init(&client_fd);
+  s32 s = mbedtls_net_accept(&w->listen_fd, &client_fd, NULL, 0, NULL);
+  if (s == MBEDTLS_ERR_SSL_WANT_READ)
+    return false; // backlog drained
+  if (s != 0) {
+    printf("Failed to accept: -0x%x\n", (u32)-s);
+    return false;
+  }
+  puts("Accepted a connection");
+
+  s = mbedtls_net_set_nonblock(&client_fd);
+  if (s != 0) {
+    perror("Failed to make client socket non-blocking");
+    mbedtls_net_free(&client_fd);
+    return true;
+  }
+
+  usize slot;
+  if (SliceLen(w->free_slots) > 0) {
+    slot = w->free_slots.items[--w->free_slots.len];
+  } else if (SliceLen(w->clients) < ((usize)1 << RPC_CLIENT_SLOT_BITS)) {
+    slot = SliceLen(w->clients);
+    SliceAppend(&w->clients, NULL);
+  } else {
+    puts("Too many clients, dropping connection");
+    mbedtls_net_free(&client_fd);
+    return true;
+  }
+
+  RpcClient *c = mem_reserve_commit(w->mb, sizeof(RpcClient));
+  *c = (RpcClient){
+    .id     = RpcClientIdMake(w->index, ++w->client_gen, slot),
+    .fd     = client_fd,
+    .server = w->server,
+    .worker = w,
+    .state  = RpcClientState_Handshake,
+    .rstate = RpcClientReadState_Start,
+    .rbuf   = SliceNew(u8, &w->bufs.mb),
+    .wbuf   = SliceNew(u8, &w->bufs.mb),
+  };
+  w->clients.items[slot] = c;
+  if (w->server->config.handshake_timeout_ms != 0)
+    timer_arm(&w->timers, &c->idle, os_now_ms() + w->server->config.handshake_timeout_ms, rpc_client_idle_check, c);
+
+  mbedtls_ssl_init(&c->ssl);
+  s = mbedtls_ssl_setup(&c->ssl, &w->conf);
+  if (s != 0) {
+    printf("Failed to run SSL setup: -0x%x\n", (u32)-s);
+    rpc_client_close(c);
+    return true;
+  }
+  // Must point into c, which stays put for the lifetime of the connection.
+  mbedtls_ssl_set_bio(&c->ssl, &c->fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+
+  struct epoll_event ev = {
+    .events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+    .data.ptr = c,
+  };
+  if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd.fd, &ev) == -1) {
+    perror("Failed to register client with epoll");
+    rpc_client_close(c);
+    return true;
+  }
+  return true;
+}
+
+function void
+rpc_worker_accept(RpcWorker *w) {
+  while (true) {
+    TraceBegin("accept", w->index);
+    bool more = rpc_worker_accept_one(w);
+    TraceEnd("accept", w->index);
+    if (!more) return;
+  }
+}
+
+// Like mbedtls_net_bind, but sets SO_REUSEPORT so every worker can have
+// a listening socket of its own on the same port.
+function s32
+rpc_worker_listen(RpcWorker *w, const char *port) {
+  struct addrinfo hints = {
+    .ai_family   = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_protocol = IPPROTO_TCP,
+    .ai_flags    = AI_PASSIVE,
+  };
+  struct addrinfo *addrs;
+  if (getaddrinfo(NULL, port, &hints, &addrs) != 0)
+    return MBEDTLS_ERR_NET_UNKNOWN_HOST;
+
+  s32 s = MBEDTLS_ERR_NET_BIND_FAILED;
+  for (struct addrinfo *ai = addrs; ai != NULL; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd == -1) {
+      s = MBEDTLS_ERR_NET_SOCKET_FAILED;
+      continue;
+    }
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+      close(fd);
+      s = MBEDTLS_ERR_NET_SOCKET_FAILED;
+      continue;
+    }
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+      close(fd);
+      s = MBEDTLS_ERR_NET_BIND_FAILED;
+      continue;
+    }
+    if (listen(fd, SOMAXCONN) == -1) {
+      close(fd);
+      s = MBEDTLS_ERR_NET_LISTEN_FAILED;
+      continue;
+    }
+    w->listen_fd.fd = fd;
+    s = 0;
+    break;
+  }
+  freeaddrinfo(addrs);
+  return s;
+}
+
+function s32
+rpc_worker_run(RpcWorker *w) {
+  rpc_current_worker = w;
+  TraceThreadName("io");
+  struct epoll_event events[RPC_MAX_EVENTS];
+  while (true) {
+    s32 timeout = -1;
+    u64 idle = timer_wheel_idle_ticks(&w->timers);
+    if (idle != U64_MAX) {
+      u64 due = w->timers.now + idle, now = os_now_ms();
+      timeout = due > now ? (s32)Min(due - now, (u64)S32_MAX) : 0;
+    }
+    // Memory freed by other workers doesn't wake us up, so poll while clients are paused.
+    if (SliceLen(w->paused) > 0 && (timeout == -1 || timeout > RPC_PAUSED_POLL_MS))
+      timeout = RPC_PAUSED_POLL_MS;
+    s32 n = epoll_wait(w->epoll_fd, events, ArrayCount(events), timeout);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait failed");
+      return errno;
+    }
+    for (s32 i = 0; i < n; i++) {
+      void *p = events[i].data.ptr;
+      if (p == NULL)   rpc_worker_accept(w);
+      else if (p == w) rpc_worker_drain_completions(w);
+      else             rpc_client_on_event(p, events[i].events);
+    }
+    timer_wheel_advance(&w->timers, os_now_ms());
+    rpc_worker_flush_dirty(w);
+    if (SliceLen(w->paused) > 0) {
+      // Flushing may have drained enough output; whatever resumed clients produce
+      // has to go out before the next wait.
+      rpc_worker_resume_paused(w);
+      rpc_worker_flush_dirty(w);
+    }
+  }
+}
+
+function void *
+rpc_worker_thread(void *ctx) {
+  rpc_worker_run(ctx);
+  return NULL;
+}
+
+function s32
+rpc_worker_start(RpcWorker *w) {
+  s32 s = rpc_worker_listen(w, RPC_PORT);
+  if (s != 0) {
+    perror("Failed to bind");
+    return s;
+  }
+
+  w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (w->epoll_fd == -1) {
+    perror("Failed to create epoll instance");
+    return errno;
+  }
+  // The listening socket is the only registration with a NULL data pointer.
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd.fd, &ev) == -1) {
+    perror("Failed to register listening socket with epoll");
+    return errno;
+  }
+
+  w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (w->wake_fd == -1) {
+    perror("Failed to create eventfd");
+    return errno;
+  }
+  // Completions are announced with the worker itself as data pointer.
+  ev = (struct epoll_event){ .events = EPOLLIN, .data.ptr = w };
+  if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &ev) == -1) {
+    perror("Failed to register eventfd with epoll");
+    return errno;
+  }
+  return 0;
+}
+
+// Numbers the registered procedures and gives every worker its metrics slots.
+function void
+rpc_server_metrics_init(RpcServer *srv) {
+  RpcDispatchTable *t = &srv->dispatch;
+  srv->procs   = mem_reserve_commit(srv->mb, (t->len + 1) * sizeof(u64));
+  srv->n_procs = 0;
+  for (usize i = 0; t->entries != NULL && i < ((usize)1 << t->shift); i++) {
+    if (t->entries[i].hdl.f == NULL) continue;
+    t->entries[i].hdl.metrics  = (u32)srv->n_procs;
+    srv->procs[srv->n_procs++] = t->entries[i].hdl.uid;
+  }
+  for (usize i = 0; i < srv->n_workers; i++) {
+    RpcWorker *w = &srv->workers[i];
+    w->metrics_mem_size = (srv->n_procs + 1) * sizeof(RpcProcMetrics) + CACHE_LINE_SIZE;
+    w->metrics_mem      = mem_reserve_commit(w->mb, w->metrics_mem_size);
+    memset(w->metrics_mem, 0, w->metrics_mem_size);
+    w->metrics = (RpcProcMetrics *)(((usize)w->metrics_mem + CACHE_LINE_SIZE - 1) & ~(usize)(CACHE_LINE_SIZE - 1));
+  }
+}
+
+function void
+rpc_worker_count_request(RpcWorker *w, u32 metrics, usize bytes) {
+  RpcProcMetrics *m = &w->metrics[metrics];
+  RpcStatInc(m->requests);
+  RpcStatAdd(m->request_bytes, bytes);
+}
+
+function void
+rpc_worker_count_response(RpcWorker *w, u32 metrics, u8 code, usize bytes, u64 ns) {
+  RpcProcMetrics *m = &w->metrics[metrics];
+  usize bucket = 0;
+  for (u64 us = ns / 1000; us != 0 && bucket < RPC_METRICS_LATENCY_BUCKETS - 1; us >>= 1) bucket++;
+  RpcStatInc(m->responses[code < RPC_METRICS_STATUSES ? code : RpcStatus_Unknown]);
+  RpcStatAdd(m->response_bytes, bytes);
+  RpcStatInc(m->latency[bucket]);
+  RpcStatAdd(m->latency_ns, ns);
+}
+
+// Adds up the metrics of all workers for procedure metrics (an index).
+function void
+rpc_server_merge_metrics(RpcServer *srv, u32 metrics, RpcProcMetrics *total) {
+  *total = (RpcProcMetrics){0};
+  for (usize i = 0; i < srv->n_workers; i++) {
+    RpcProcMetrics *m = &srv->workers[i].metrics[metrics];
+    total->requests       += __atomic_load_n(&m->requests,       __ATOMIC_RELAXED);
+    total->request_bytes  += __atomic_load_n(&m->request_bytes,  __ATOMIC_RELAXED);
+    total->response_bytes += __atomic_load_n(&m->response_bytes, __ATOMIC_RELAXED);
+    total->latency_ns     += __atomic_load_n(&m->latency_ns,     __ATOMIC_RELAXED);
+    for (usize j = 0; j < RPC_METRICS_STATUSES; j++)
+      total->responses[j] += __atomic_load_n(&m->responses[j], __ATOMIC_RELAXED);
+    for (usize j = 0; j < RPC_METRICS_LATENCY_BUCKETS; j++)
+      total->latency[j] += __atomic_load_n(&m->latency[j], __ATOMIC_RELAXED);
   }
+}
 
-  puts("Certificates read");
+function void
+rpc_metrics_appendf(Slice(u8) *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 
-  mbedtls_ctr_drbg_init(&srv->ctr_drbg);
-  mbedtls_entropy_init(&srv->entropy);
-  const char *pers = "ssl_server";
-  s = mbedtls_ctr_drbg_seed(&srv->ctr_drbg, mbedtls_entropy_func, &srv->entropy, (const u8 *)pers, strlen(pers));
-  if (s != 0) {
-    perror("Failed to seed random number generator");
-    return s;
+function void
+rpc_metrics_appendf(Slice(u8) *out, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  s32 n = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  if (n <= 0) return;
+  SliceReserve(out, (usize)n + 1);
+  va_start(args, fmt);
+  vsnprintf((char *)out->items + out->len, (usize)n + 1, fmt, args);
+  va_end(args);
+  out->len += (usize)n;
+}
+
+// Appends the metrics of all procedures in the Prometheus text exposition format.
+// Unknown procedures are reported as procedure="unknown".
+function void
+rpc_server_metrics_text(RpcServer *srv, Slice(u8) *out) {
+  local const char *names[] = {
+#define X(name, code) [code] = #name,
+    XM_RPC_STATUSES
+#undef X
+  };
+  usize n = srv->n_procs + 1;
+  RpcProcMetrics *all = mem_reserve_commit(srv->mb, n * sizeof(RpcProcMetrics));
+  char (*procs)[32]   = mem_reserve_commit(srv->mb, n * sizeof(*procs));
+  for (usize p = 0; p < n; p++) {
+    rpc_server_merge_metrics(srv, (u32)p, &all[p]);
+    if (p < srv->n_procs) snprintf(procs[p], sizeof(*procs), "0x%llx", (unsigned long long)srv->procs[p]);
+    else                  snprintf(procs[p], sizeof(*procs), "unknown");
   }
 
-  mbedtls_ssl_config_init(&srv->conf);
-  s = mbedtls_ssl_config_defaults(&srv->conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
-  if (s != 0) {
-    perror("Failed to set up SSL config");
-    return s;
+  // Every family has to be listed in one go.
+  rpc_metrics_appendf(out, "# TYPE rpc_requests_total counter\n");
+  for (usize p = 0; p < n; p++) {
+    if (all[p].requests == 0) continue;
+    rpc_metrics_appendf(out, "rpc_requests_total{procedure=\"%s\"} %llu\n", procs[p], (unsigned long long)all[p].requests);
+  }
+  rpc_metrics_appendf(out, "# TYPE rpc_request_bytes_total counter\n");
+  for (usize p = 0; p < n; p++) {
+    if (all[p].requests == 0) continue;
+    rpc_metrics_appendf(out, "rpc_request_bytes_total{procedure=\"%s\"} %llu\n", procs[p], (unsigned long long)all[p].request_bytes);
+  }
+  rpc_metrics_appendf(out, "# TYPE rpc_responses_total counter\n");
+  for (usize p = 0; p < n; p++) {
+    for (usize s = 0; s < RPC_METRICS_STATUSES; s++) {
+      if (all[p].responses[s] == 0) continue;
+      rpc_metrics_appendf(out, "rpc_responses_total{procedure=\"%s\",status=\"%s\"} %llu\n",
+                          procs[p], names[s], (unsigned long long)all[p].responses[s]);
+    }
   }
+  rpc_metrics_appendf(out, "# TYPE rpc_response_bytes_total counter\n");
+  for (usize p = 0; p < n; p++) {
+    if (all[p].requests == 0) continue;
+    rpc_metrics_appendf(out, "rpc_response_bytes_total{procedure=\"%s\"} %llu\n", procs[p], (unsigned long long)all[p].response_bytes);
+  }
+  rpc_metrics_appendf(out, "# TYPE rpc_latency_seconds histogram\n");
+  for (usize p = 0; p < n; p++) {
+    if (all[p].requests == 0) continue;
+    u64 cumulative = 0;
+    for (usize b = 0; b < RPC_METRICS_LATENCY_BUCKETS; b++) {
+      cumulative += all[p].latency[b];
+      if (b == RPC_METRICS_LATENCY_BUCKETS - 1) break;
+      rpc_metrics_appendf(out, "rpc_latency_seconds_bucket{procedure=\"%s\",le=\"%g\"} %llu\n",
+                          procs[p], (f64)((u64)1 << b) / 1e6, (unsigned long long)cumulative);
+    }
+    rpc_metrics_appendf(out, "rpc_latency_seconds_bucket{procedure=\"%s\",le=\"+Inf\"} %llu\n", procs[p], (unsigned long long)cumulative);
+    rpc_metrics_appendf(out, "rpc_latency_seconds_sum{procedure=\"%s\"} %.9f\n", procs[p], (f64)all[p].latency_ns / 1e9);
+    rpc_metrics_appendf(out, "rpc_latency_seconds_count{procedure=\"%s\"} %llu\n", procs[p], (unsigned long long)cumulative);
+  }
+
+  rpc_metrics_appendf(out, "# TYPE rpc_buffer_memory_bytes gauge\n");
+  rpc_metrics_appendf(out, "rpc_buffer_memory_bytes %llu\n", (unsigned long long)rpc_server_buffer_memory(srv));
+  rpc_metrics_appendf(out, "# TYPE rpc_buffer_memory_limit_bytes gauge\n");
+  rpc_metrics_appendf(out, "rpc_buffer_memory_limit_bytes %llu\n", (unsigned long long)srv->config.max_buffer_memory);
+  RpcBufPoolStats pool = rpc_server_buf_pool_stats(srv);
+  rpc_metrics_appendf(out, "# TYPE rpc_buffer_pool_acquires_total counter\n");
+  rpc_metrics_appendf(out, "rpc_buffer_pool_acquires_total{result=\"hit\"} %llu\n",  (unsigned long long)pool.hits);
+  rpc_metrics_appendf(out, "rpc_buffer_pool_acquires_total{result=\"miss\"} %llu\n", (unsigned long long)pool.misses);
+  rpc_metrics_appendf(out, "# TYPE rpc_buffer_pool_releases_total counter\n");
+  rpc_metrics_appendf(out, "rpc_buffer_pool_releases_total{result=\"pooled\"} %llu\n",  (unsigned long long)pool.returns);
+  rpc_metrics_appendf(out, "rpc_buffer_pool_releases_total{result=\"dropped\"} %llu\n", (unsigned long long)pool.drops);
 
-  mbedtls_ssl_conf_rng(&srv->conf, mbedtls_ctr_drbg_random, &srv->ctr_drbg);
+  RpcTlsStats tls = rpc_server_tls_stats(srv);
+  rpc_metrics_appendf(out, "# TYPE rpc_tls_handshakes_total counter\n");
+  rpc_metrics_appendf(out, "rpc_tls_handshakes_total %llu\n", (unsigned long long)tls.handshakes);
+  rpc_metrics_appendf(out, "# TYPE rpc_tls_resumptions_total counter\n");
+  rpc_metrics_appendf(out, "rpc_tls_resumptions_total{via=\"cache\",result=\"hit\"} %llu\n",   (unsigned long long)tls.cache_hits);
+  rpc_metrics_appendf(out, "rpc_tls_resumptions_total{via=\"cache\",result=\"miss\"} %llu\n",  (unsigned long long)tls.cache_misses);
+  rpc_metrics_appendf(out, "rpc_tls_resumptions_total{via=\"ticket\",result=\"hit\"} %llu\n",  (unsigned long long)tls.ticket_hits);
+  rpc_metrics_appendf(out, "rpc_tls_resumptions_total{via=\"ticket\",result=\"miss\"} %llu\n", (unsigned long long)tls.ticket_misses);
+  rpc_metrics_appendf(out, "# TYPE rpc_tls_ktls_offloads_total counter\n");
+  rpc_metrics_appendf(out, "rpc_tls_ktls_offloads_total %llu\n", (unsigned long long)tls.ktls_offloads);
 
-  mbedtls_ssl_cache_init(&srv->cache);
-  mbedtls_ssl_conf_session_cache(&srv->conf, &srv->cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+  RpcReapStats reap = rpc_server_reap_stats(srv);
+  rpc_metrics_appendf(out, "# TYPE rpc_reaped_connections_total counter\n");
+  rpc_metrics_appendf(out, "rpc_reaped_connections_total{reason=\"idle\"} %llu\n",      (unsigned long long)reap.idle);
+  rpc_metrics_appendf(out, "rpc_reaped_connections_total{reason=\"handshake\"} %llu\n", (unsigned long long)reap.handshakes);
+  rpc_metrics_appendf(out, "# TYPE rpc_reaped_bytes_total counter\n");
+  rpc_metrics_appendf(out, "rpc_reaped_bytes_total %llu\n", (unsigned long long)reap.bytes);
 
-  mbedtls_ssl_conf_ca_chain(&srv->conf, srv->cert.next, NULL);
-  s = mbedtls_ssl_conf_own_cert(&srv->conf, &srv->cert, &srv->pk);
+  Mem_TagStats mem[Mem_Tag_COUNT];
+  for (usize t = 1; t < Mem_Tag_COUNT; t++) mem[t] = mem_tag_stats((Mem_Tag)t);
+  rpc_metrics_appendf(out, "# TYPE rpc_memory_reserved_bytes gauge\n");
+  for (usize t = 1; t < Mem_Tag_COUNT; t++)
+    rpc_metrics_appendf(out, "rpc_memory_reserved_bytes{tag=\"%s\"} %llu\n", mem_tag_name((Mem_Tag)t), (unsigned long long)mem[t].reserved);
+  rpc_metrics_appendf(out, "# TYPE rpc_memory_committed_bytes gauge\n");
+  for (usize t = 1; t < Mem_Tag_COUNT; t++)
+    rpc_metrics_appendf(out, "rpc_memory_committed_bytes{tag=\"%s\"} %llu\n", mem_tag_name((Mem_Tag)t), (unsigned long long)mem[t].committed);
+  rpc_metrics_appendf(out, "# TYPE rpc_memory_committed_peak_bytes gauge\n");
+  for (usize t = 1; t < Mem_Tag_COUNT; t++)
+    rpc_metrics_appendf(out, "rpc_memory_committed_peak_bytes{tag=\"%s\"} %llu\n", mem_tag_name((Mem_Tag)t), (unsigned long long)mem[t].peak_committed);
+  rpc_metrics_appendf(out, "# TYPE rpc_memory_reservations_total counter\n");
+  for (usize t = 1; t < Mem_Tag_COUNT; t++)
+    rpc_metrics_appendf(out, "rpc_memory_reservations_total{tag=\"%s\"} %llu\n", mem_tag_name((Mem_Tag)t), (unsigned long long)mem[t].reservations);
+  rpc_metrics_appendf(out, "# TYPE rpc_memory_releases_total counter\n");
+  for (usize t = 1; t < Mem_Tag_COUNT; t++)
+    rpc_metrics_appendf(out, "rpc_memory_releases_total{tag=\"%s\"} %llu\n", mem_tag_name((Mem_Tag)t), (unsigned long long)mem[t].releases);
+
+  mem_decommit_release(srv->mb, procs, n * sizeof(*procs));
+  mem_decommit_release(srv->mb, all, n * sizeof(RpcProcMetrics));
+}
+
+// Built-in procedure 1: the ok payload is rpc_server_metrics_text.
+function void
+rpc_metrics_handler(RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx) {
+  (void)ctx;
+  RpcResponse rsp = {
+    .client_id  = req.client_id,
+    .request_id = req.request_id,
+    .code   = RpcStatus_Ok,
+    .family = RpcFamilyStatus(RpcStatus_Ok),
+    .data   = SliceNew(u8, &scratch->base),
+  };
+  rpc_server_metrics_text(srv, &rsp.data);
+  rpc_server_respond(srv, rsp);
+}
+
+#if ENABLE_TRACE
+// Built-in procedure 2: writes what every thread has traced to config.trace_path.
+function void
+rpc_trace_handler(RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx) {
+  (void)scratch; (void)ctx;
+  FILE *f = fopen(srv->config.trace_path, "w");
+  s32 s = f != NULL ? trace_dump(f) : errno;
+  if (f != NULL && fclose(f) != 0 && s == 0) s = errno;
   if (s != 0) {
-    perror("Failed to set up certificate");
-    return s;
+    errno = s;
+    perror("Failed to write trace");
   }
-  return 0;
+  rpc_server_respond_status(srv, &req, s == 0 ? RpcStatus_Ok : RpcStatus_Internal);
 }
+#endif
 
 function s32
 run_rpc_server(RpcServer *srv) {
-  puts("Listening");
+  printf("Listening with %zu workers\n", srv->n_workers);
 
-  mbedtls_net_init(&srv->listen_fd);
-  int s = mbedtls_net_bind(&srv->listen_fd, NULL, "4433", MBEDTLS_NET_PROTO_TCP);
-  if (s != 0) {
-    perror("Failed to bind");
-    return s;
+  rpc_dispatch_freeze(srv->mb, &srv->dispatch);
+  rpc_server_metrics_init(srv);
+  RpcHandler *ping = rpc_dispatch_lookup(&srv->dispatch, RPC_PROC_PING);
+  srv->ping_inline  = ping != NULL && ping->f == rpc_ping_handler;
+  srv->ping_metrics = ping != NULL ? ping->metrics : (u32)srv->n_procs;
+
+  // Streams are written out while their handler runs, which an I/O thread busy running it can't do.
+  if (srv->streaming && srv->pool.n_threads == 0) {
+    s32 s = rpc_handler_pool_init(srv, 1);
+    if (s != 0) return s;
+    srv->pool.streaming_only = true;
+  }
+  for (usize i = 0; i < srv->pool.n_threads; i++) {
+    s32 s = thread_spawn(&srv->pool.threads[i], rpc_pool_thread, srv);
+    if (s != 0) {
+      errno = s;
+      perror("Failed to spawn handler thread");
+      return s;
+    }
   }
 
-  mbedtls_ssl_context ssl;
-Reset:
-  mbedtls_ssl_init(&ssl);
-  s = mbedtls_ssl_setup(&ssl, &srv->conf);
-  if (s != 0) {
-    perror("Failed to run SSL setup");
-    return s;
+  // Bind every socket before any worker starts accepting, so a bind failure
+  // doesn't leave a partially running server behind.
+  for (usize i = 0; i < srv->n_workers; i++) {
+    s32 s = rpc_worker_start(&srv->workers[i]);
+    if (s != 0) return s;
   }
 
-  mbedtls_net_context client_fd;
-  mbedtls_net_init(&client_fd);
+  // The calling thread doubles as worker 0.
+  for (usize i = 1; i < srv->n_workers; i++) {
+    s32 s = thread_spawn(&srv->workers[i].thread, rpc_worker_thread, &srv->workers[i]);
+    if (s != 0) {
+      errno = s;
+      perror("Failed to spawn worker thread");
+      return s;
+    }
+  }
+  s32 s = rpc_worker_run(&srv->workers[0]);
+  for (usize i = 1; i < srv->n_workers; i++)
+    thread_join(&srv->workers[i].thread);
+  return s;
+}
 
-  mbedtls_net_free(&client_fd);
-  mbedtls_ssl_session_reset(&ssl);
+// [compressed marker] <status, u8> <response ID, vu64> <payload length, vu64> <response family ID, u8> <payload>
+#define RPC_RESPONSE_HEADER_MAX (1 + 1 + 2 * RPC_VU64_MAX_LEN + 1)
 
-  puts("Accepting");
-  s = mbedtls_net_accept(&srv->listen_fd, &client_fd, NULL, 0, NULL);
-  if (s != 0) {
-    perror("Failed to accept");
-    return s;
+function usize
+write_vu64(u8 *dest, u64 x) {
+  usize n = 1;
+  for (u64 rest = x >> 7; rest != 0; rest >>= 7) n++;
+  for (usize i = n; i > 0; i--) {
+    dest[i - 1] = (u8)((x & 0x7F) | (i == n ? 0 : 0x80));
+    x >>= 7;
   }
-  puts("Accepted a connection");
+  return n;
+}
+
+// Encodes a response at the end of the wbuf of c.
+// compressed: payload went through rpc_payload_deflate.
+function void
+rpc_client_encode_response(RpcClient *c, u8 code, u64 request_id, u8 family, String payload, bool compressed) {
+  rpc_buf_reserve(&c->worker->bufs, &c->wbuf, RPC_RESPONSE_HEADER_MAX + payload.len);
+  u8 *p = c->wbuf.items + c->wbuf.len;
+  if (compressed) *p++ = RPC_COMPRESSED_MARKER;
+  *p++ = code;
+  p += write_vu64(p, request_id);
+  p += write_vu64(p, payload.len);
+  *p++ = family;
+  if (payload.len > 0) memcpy(p, payload.buf, payload.len);
+  p += payload.len;
+  c->wbuf.len = (usize)(p - c->wbuf.items);
+}
+
+// Queues a chunk of the streamed response to request_id. Returns false if the stream
+// has nowhere to go: the client is gone or the request has been answered already.
+function bool
+rpc_client_stream_chunk(RpcClient *c, u64 request_id, u8 family, String data, bool compressed) {
+  RpcInflight *e = NULL;
+  if (request_id != 0 && c != NULL && c->state == RpcClientState_Open)
+    e = rpc_inflight_find(&c->inflight, request_id);
+  if (e == NULL) return false;
+  RpcStatAdd(c->worker->metrics[e->metrics].response_bytes, data.len);
+  rpc_client_encode_response(c, RPC_STATUS_STREAM_CHUNK, request_id, family, data, compressed);
+  rpc_client_queue_flush(c);
+  return true;
+}
+
+// The response to ping is always VoidResponse.ok with an empty payload, so all of it
+// but the response ID is fixed: <status 00> <response ID> <payload length 00> <family 80>.
+global const u8 rpc_ping_response_head[] = { RpcStatus_Ok };
+global const u8 rpc_ping_response_tail[] = { 0x00, RpcFamilyStatus(RpcStatus_Ok) };
+#define RPC_PING_RESPONSE_MAX (sizeof(rpc_ping_response_head) + RPC_VU64_MAX_LEN + sizeof(rpc_ping_response_tail))
+
+// Answers a ping right from the parser: no handler, no completion, no inflight entry.
+// Nothing is allocated unless wbuf has to come from an empty buffer pool.
+function void
+rpc_client_answer_ping(RpcClient *c, u64 request_id) {
+  rpc_buf_reserve(&c->worker->bufs, &c->wbuf, RPC_PING_RESPONSE_MAX);
+  u8 *p = c->wbuf.items + c->wbuf.len;
+  memcpy(p, rpc_ping_response_head, sizeof(rpc_ping_response_head));
+  p += sizeof(rpc_ping_response_head);
+  p += write_vu64(p, request_id);
+  memcpy(p, rpc_ping_response_tail, sizeof(rpc_ping_response_tail));
+  p += sizeof(rpc_ping_response_tail);
+  c->wbuf.len = (usize)(p - c->wbuf.items);
+  rpc_client_queue_flush(c);
+}
+
+// The job whose handler runs on the current handler thread, if any.
+global _Thread_local RpcJob *rpc_current_job;
+
+// Whether a response payload of len bytes for client_id, produced on the current
+// thread, is worth compressing. Only handler threads compress, and only for their
+// own client: the I/O threads have better things to do.
+function bool
+rpc_should_deflate(RpcServer *srv, u64 client_id, usize len) {
+  RpcJob *job = rpc_current_job;
+  return job != NULL && job->compress && job->req.client_id == client_id &&
+         srv->config.compress_min_size != 0 && len >= srv->config.compress_min_size;
+}
+
+// Replaces data with <uncompressed length, vu64> <lz_compress block>, if that's shorter.
+// Returns whether it did.
+function bool
+rpc_payload_deflate(Mem_Base *mb, Slice(u8) *data) {
+  usize n = data->len;
+  if (n <= RPC_VU64_MAX_LEN + 1) return false;
+  Slice(u8) z = SliceNew(u8, mb);
+  SliceReserve(&z, n);
+  usize head = write_vu64(z.items, n);
+  usize body = lz_compress(data->items, n, z.items + head, n - head - 1);
+  if (body == 0) {
+    SliceDestroy(z);
+    return false;
+  }
+  z.len = head + body;
+  SliceDestroy(*data);
+  *data = z;
+  return true;
+}
+
+// Decompresses a payload made by rpc_payload_deflate into scratch.
+// Returns false if it's malformed or would be longer than RPC_MAX_PAYLOAD.
+function bool
+rpc_payload_inflate(Mem_Arena *scratch, String payload, String *out) {
+  u64   len = 0;
+  u8    n   = 0;
+  usize consumed;
+  if (try_read_vu64(payload, &len, &n, &consumed) != RpcDecodeStatus_Done || len > RPC_MAX_PAYLOAD) return false;
+  *out = string_from_raw(NULL, 0);
+  if (len == 0) return true;
+  u8 *buf = mem_arena_push(scratch, (usize)len);
+  if (buf == NULL || !lz_decompress(payload.buf + consumed, payload.len - consumed, buf, (usize)len)) return false;
+  *out = string_from_raw(buf, (usize)len);
+  return true;
+}
+
+// Queues rsp on its client. The actual write happens at the end of the current
+// event loop iteration, together with all other output produced in it.
+// May be called from any thread: off the owning I/O thread, the response is
+// handed over through the completion queue of the owning worker, compressed
+// first if the client negotiated it and it's long enough.
+function void
+rpc_server_respond(RpcServer *srv, RpcResponse rsp) {
+  usize wi = RpcClientIdWorker(rsp.client_id);
+  if (wi < srv->n_workers && rpc_current_worker != &srv->workers[wi]) {
+    RpcCompletion *cmp = mem_reserve_commit(srv->objs, sizeof(RpcCompletion));
+    *cmp = (RpcCompletion){ .kind = RpcCompletionKind_Response, .rsp = rsp };
+    cmp->compressed = rpc_should_deflate(srv, rsp.client_id, rsp.data.len) && rpc_payload_deflate(srv->mb, &cmp->rsp.data);
+    rpc_worker_post(&srv->workers[wi], &cmp->node);
+    return;
+  }
+  rpc_worker_respond(srv, rsp, false);
+}
+
+// rpc_server_respond on the I/O thread owning the client.
+function void
+rpc_worker_respond(RpcServer *srv, RpcResponse rsp, bool compressed) {
+  RpcClient *c = rpc_server_client(srv, rsp.client_id);
+  // Requests with response ID 00 don't get a response, the client may have disconnected
+  // in the meantime and handlers must respond to every request only once.
+  RpcInflight *e = NULL;
+  if (rsp.request_id != 0 && c != NULL && c->state == RpcClientState_Open)
+    e = rpc_inflight_find(&c->inflight, rsp.request_id);
+  if (e != NULL) {
+    rpc_worker_count_response(c->worker, e->metrics, rsp.code, rsp.data.len, os_now_ns() - e->started);
+    rpc_inflight_remove(&c->inflight, e);
+    rpc_client_encode_response(c, rsp.code, rsp.request_id, rsp.family, string_from_raw(rsp.data.items, rsp.data.len), compressed);
+    rpc_client_queue_flush(c);
+  }
+  if (rsp.data.items != NULL) SliceDestroy(rsp.data);
+}
+
+// Maps x to [0, 1 << shift). Fibonacci hashing: the top bits of the product
+// are well mixed even for sequential IDs.
+function usize
+rpc_hash_u64(u64 x, u8 shift) {
+  return (usize)((x * 0x9E3779B97F4A7C15ull) >> (64 - shift));
+}
 
-  mbedtls_ssl_set_bio(&ssl, &client_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+function RpcHandler *
+rpc_dispatch_lookup(RpcDispatchTable *t, u64 uid) {
+  if (Unlikely(t->entries == NULL)) return NULL;
+  usize mask = ((usize)1 << t->shift) - 1;
+  for (usize i = rpc_hash_u64(uid, t->shift);; i = (i + 1) & mask) {
+    RpcHandler *h = &t->entries[i].hdl;
+    if (h->f == NULL)   return NULL;
+    if (h->uid == uid) return h;
+  }
+}
 
-  while ((s = mbedtls_ssl_handshake(&ssl)) != 0) {
-    if (s != MBEDTLS_ERR_SSL_WANT_READ && s != MBEDTLS_ERR_SSL_WANT_WRITE) {
-      perror("SSL handshake failed");
-      goto Reset;
+// Places hdl in a table known to have room for it, returns how far it ended up from its home entry.
+function usize
+rpc_dispatch_place(RpcDispatchEntry *entries, u8 shift, RpcHandler hdl) {
+  usize mask = ((usize)1 << shift) - 1;
+  usize home = rpc_hash_u64(hdl.uid, shift);
+  for (usize i = home;; i = (i + 1) & mask) {
+    if (entries[i].hdl.f == NULL || entries[i].hdl.uid == hdl.uid) {
+      entries[i].hdl = hdl;
+      return (i - home) & mask;
     }
   }
+}
 
-  puts("Handshake succeeded");
+// Rebuilds t with 1 << shift entries. Returns false if some handler ended up outside
+// of the cache line its home entry is in.
+function bool
+rpc_dispatch_rebuild(Mem_Base *mb, RpcDispatchTable *t, u8 shift) {
+  usize n        = (usize)1 << shift;
+  usize mem_size = n * sizeof(RpcDispatchEntry) + CACHE_LINE_SIZE;
+  void *mem      = mem_reserve_commit(mb, mem_size);
+  memset(mem, 0, mem_size);
+  RpcDispatchEntry *entries = (RpcDispatchEntry *)(((usize)mem + CACHE_LINE_SIZE - 1) & ~(usize)(CACHE_LINE_SIZE - 1));
 
-  u8 buf[4096];
-  while (1) {
-    memset(buf, 0, sizeof(buf));
-    s = mbedtls_ssl_read(&ssl, buf, sizeof(buf)-1);
+  bool in_home_line = true;
+  for (usize i = 0; t->entries != NULL && i < ((usize)1 << t->shift); i++) {
+    RpcHandler hdl = t->entries[i].hdl;
+    if (hdl.f == NULL) continue;
+    usize home = rpc_hash_u64(hdl.uid, shift);
+    usize dist = rpc_dispatch_place(entries, shift, hdl);
+    if ((home % RPC_DISPATCH_ENTRIES_PER_LINE) + dist >= RPC_DISPATCH_ENTRIES_PER_LINE)
+      in_home_line = false;
+  }
 
-    if (s == MBEDTLS_ERR_SSL_WANT_READ || s == MBEDTLS_ERR_SSL_WANT_WRITE)
-      continue;
+  if (t->mem != NULL) mem_decommit_release(mb, t->mem, t->mem_size);
+  t->entries  = entries;
+  t->mem      = mem;
+  t->mem_size = mem_size;
+  t->shift    = shift;
+  return in_home_line;
+}
 
-    if (s <= 0) {
-      switch (s) {
-      case MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY:
-        puts("Connection was closed gracefully");
-        break;
-      case MBEDTLS_ERR_NET_CONN_RESET:
-        puts("Connection was reset by peer");
-        break;
-      default:
-        printf("Error: mbedtls_ssl_read returned -0x%x\n", (u32) -s);
-        break;
+function void
+rpc_dispatch_insert(Mem_Base *mb, RpcDispatchTable *t, RpcHandler hdl) {
+  Assert(!t->frozen);
+  Assert(hdl.f != NULL);
+  // Keep the load factor at or below 1/2.
+  if (t->entries == NULL || (t->len + 1) * 2 > ((usize)1 << t->shift))
+    rpc_dispatch_rebuild(mb, t, t->entries == NULL ? RPC_DISPATCH_MIN_SHIFT : (u8)(t->shift + 1));
+  if (rpc_dispatch_lookup(t, hdl.uid) != NULL) {
+    printf("Warning: replacing the handler for procedure %#llx\n", (unsigned long long)hdl.uid);
+  } else {
+    t->len++;
+  }
+  rpc_dispatch_place(t->entries, t->shift, hdl);
+}
+
+// Called once before serving: spreads the table out (within limits) until every
+// handler sits in the cache line of its home entry. After this the table is read-only.
+function void
+rpc_dispatch_freeze(Mem_Base *mb, RpcDispatchTable *t) {
+  if (t->entries != NULL) {
+    u8 max_shift = (u8)(t->shift + RPC_DISPATCH_MAX_SPREAD);
+    u8 shift = t->shift;
+    while (!rpc_dispatch_rebuild(mb, t, shift) && shift < max_shift)
+      shift++;
+  }
+  t->frozen = true;
+}
+
+// Responds to req with just a status and no payload.
+function void
+rpc_server_respond_status(RpcServer *srv, RpcRequest *req, RpcStatus code) {
+  RpcResponse rsp = {
+    .code   = (u8)code,
+    .family = RpcFamilyStatus(code),
+    .data   = SliceNew(u8, srv->mb),
+    .client_id  = req->client_id,
+    .request_id = req->request_id,
+  };
+  rpc_server_respond(srv, rsp);
+}
+
+// Whether the client has cancelled req since its handler started. Handlers doing
+// a lot of work can poll this and give up early, e.g. answering Cancelled.
+function bool
+rpc_request_cancelled(RpcRequest *req) {
+  return req->job != NULL && __atomic_load_n(&req->job->cancelled, __ATOMIC_RELAXED);
+}
+
+// Sends data (which is destroyed) as the next chunk of the response to req. A streaming
+// handler calls this for every chunk it produces and ends the stream with a regular
+// response, e.g. rpc_server_respond_status(srv, &req, RpcStatus_Ok). The client gets
+// every chunk in order, followed by that final frame.
+// Only handlers registered with streaming set may call this; they always run on a
+// handler thread, which blocks here while RPC_STREAM_WINDOW bytes of the stream are still
+// on their way out. Returns false once there's no point in producing more: the client
+// cancelled the request or went away (the handler still has to respond).
+function bool
+rpc_server_stream(RpcServer *srv, RpcRequest *req, u8 family, Slice(u8) data) {
+  RpcJob *job = req->job;
+  if (job == NULL) {
+    // An I/O thread couldn't write anything until the handler returns.
+    fputs("Error: rpc_server_stream called by a handler not registered as streaming\n", stderr);
+    if (data.items != NULL) SliceDestroy(data);
+    return false;
+  }
+
+  RpcCompletion *cmp = mem_reserve_commit(srv->objs, sizeof(RpcCompletion));
+  *cmp = (RpcCompletion){
+    .kind = RpcCompletionKind_StreamChunk,
+    .rsp  = {
+      .client_id  = req->client_id,
+      .request_id = req->request_id,
+      .code   = RPC_STATUS_STREAM_CHUNK,
+      .family = family,
+      .data   = data,
+    },
+    .job  = job,
+  };
+  // Compressed chunks count towards the window with their compressed length.
+  cmp->compressed = rpc_should_deflate(srv, req->client_id, data.len) && rpc_payload_deflate(srv->mb, &cmp->rsp.data);
+  __atomic_add_fetch(&job->stream_queued, cmp->rsp.data.len, __ATOMIC_SEQ_CST);
+  rpc_worker_post(&srv->workers[RpcClientIdWorker(req->client_id)], &cmp->node);
+  while (__atomic_load_n(&job->stream_queued, __ATOMIC_SEQ_CST) > RPC_STREAM_WINDOW && !rpc_request_cancelled(req)) {
+    __atomic_store_n(&job->stream_waiting, 1, __ATOMIC_SEQ_CST);
+    // Credit that came in before we said we're waiting wouldn't wake us up.
+    if (__atomic_load_n(&job->stream_queued, __ATOMIC_SEQ_CST) <= RPC_STREAM_WINDOW || rpc_request_cancelled(req)) break;
+    semaphore_wait(&job->stream_room);
+  }
+  return !rpc_request_cancelled(req);
+}
+
+function void
+rpc_worker_post(RpcWorker *w, MpscNode *n) {
+  mpsc_push(&w->completions, n);
+  if (__atomic_exchange_n(&w->wake_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    u64 one = 1;
+    while (write(w->wake_fd, &one, sizeof(one)) == -1 && errno == EINTR) {}
+  }
+}
+
+function void
+rpc_worker_unpin(RpcWorker *w, RpcRecvBufRef *ref, u64 client_id) {
+  if (--ref->pins > 0) return;
+  if (ref->retired) {
+    rpc_buf_pool_release(&w->bufs, ref->mb, ref->items, ref->cap);
+  } else {
+    // Not retired, so the client is still around and using this buffer.
+    RpcClient *c = rpc_server_client(w->server, client_id);
+    Assert(c != NULL && c->rbuf_ref == ref);
+    if (c != NULL) {
+      c->rbuf_ref = NULL;
+      // Everything it held has been dispatched: start over, or hand it back if idle.
+      if (c->rstart == SliceLen(c->rbuf)) {
+        c->rstart = c->rpos = 0;
+        c->rbuf.len = 0;
+        rpc_client_release_buf(c, &c->rbuf);
       }
     }
+  }
+  mem_decommit_release(w->server->objs, ref, sizeof(RpcRecvBufRef));
+}
+
+// Releasing memory through a job's scratch arena does nothing: the I/O thread destroys
+// response data (maybe allocated from it) while the handler thread may still be allocating.
+function RpcScratch *
+rpc_worker_acquire_scratch(RpcWorker *w) {
+  RpcScratch *s = w->warm_scratch;
+  if (s != NULL) {
+    w->warm_scratch = s->next;
+    w->n_warm_scratch--;
+    return s;
+  }
+  s = w->cold_scratch;
+  if (s != NULL) {
+    w->cold_scratch = s->next;
+    w->n_cold_scratch--;
+    return s;
+  }
+  s = mem_reserve_commit(w->server->objs, sizeof(RpcScratch));
+  if (mem_arena_init(&s->arena, w->server->config.scratch_reserve, Mem_Tag_Scratch) != 0) {
+    mem_decommit_release(w->server->objs, s, sizeof(RpcScratch));
+    return NULL;
+  }
+  s->arena.base.release = mem_noop_mem_change;
+  return s;
+}
+
+// However many jobs ran at the same time once, an idle worker holds on to the pages
+// of no more than scratch_warm arenas. Warm ones are handed out first.
+function void
+rpc_worker_release_scratch(RpcWorker *w, RpcScratch *s) {
+  RpcServerConfig *cfg = &w->server->config;
+  if (w->n_warm_scratch < cfg->scratch_warm) {
+    mem_arena_clear(&s->arena);
+    s->next = w->warm_scratch;
+    w->warm_scratch = s;
+    w->n_warm_scratch++;
+  } else if (w->n_warm_scratch + w->n_cold_scratch < cfg->scratch_pool) {
+    mem_arena_trim(&s->arena);
+    s->next = w->cold_scratch;
+    w->cold_scratch = s;
+    w->n_cold_scratch++;
+  } else {
+    mem_arena_destroy(&s->arena);
+    mem_decommit_release(w->server->objs, s, sizeof(RpcScratch));
+  }
+}
 
-    printf("%d bytes read\n\n%s", s, (char *)buf);
+function void
+rpc_worker_drain_completions(RpcWorker *w) {
+  u64 count;
+  while (read(w->wake_fd, &count, sizeof(count)) == -1 && errno == EINTR) {}
+  // Reset before draining: producers that push after this point write the eventfd again.
+  __atomic_store_n(&w->wake_pending, 0, __ATOMIC_SEQ_CST);
 
-    if (s > 0)
+  MpscNode *n;
+  while ((n = mpsc_pop(&w->completions)) != NULL) {
+    RpcCompletion *cmp = (RpcCompletion *)n; // node is the first member
+    switch (cmp->kind) {
+    case RpcCompletionKind_Response:
+      rpc_worker_respond(w->server, cmp->rsp, cmp->compressed);
+      mem_decommit_release(w->server->objs, cmp, sizeof(RpcCompletion));
       break;
+    case RpcCompletionKind_JobDone: {
+      RpcJob *job = (RpcJob *)cmp; // done is the first member
+      RpcClient *c = rpc_server_client(w->server, job->req.client_id);
+      if (c != NULL) {
+        c->job_bytes -= job->req.data.len;
+        // The handler may not have responded yet, it can't be cancelled any more regardless.
+        RpcInflight *e = job->req.request_id != 0 ? rpc_inflight_find(&c->inflight, job->req.request_id) : NULL;
+        if (e != NULL && e->job == job) e->job = NULL;
+      }
+      rpc_job_stream_unlink(job);
+      timer_cancel(&w->timers, &job->deadline);
+      rpc_worker_unpin(w, job->buf, job->req.client_id);
+      // Whatever the handler posted came before this and has been encoded into wbuf.
+      rpc_worker_release_scratch(w, job->scratch);
+      mem_decommit_release(w->server->objs, job, sizeof(RpcJob));
+    } break;
+    case RpcCompletionKind_StreamChunk: {
+      // Chunks come in before the JobDone of their job (both come from the same thread).
+      RpcJob    *job = cmp->job;
+      RpcClient *c   = rpc_server_client(w->server, cmp->rsp.client_id);
+      usize      len = cmp->rsp.data.len;
+      if (rpc_client_stream_chunk(c, cmp->rsp.request_id, cmp->rsp.family, string_from_raw(cmp->rsp.data.items, len), cmp->compressed)) {
+        job->stream_unsent += len;
+        job->stream_end     = SliceLen(c->wbuf);
+        if (job->stream_pprev == NULL) {
+          job->stream_next = c->streams;
+          if (c->streams != NULL) c->streams->stream_pprev = &job->stream_next;
+          job->stream_pprev = &c->streams;
+          c->streams = job;
+        }
+      } else {
+        __atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+        rpc_job_stream_credit(job, len);
+      }
+      if (cmp->rsp.data.items != NULL) SliceDestroy(cmp->rsp.data);
+      mem_decommit_release(w->server->objs, cmp, sizeof(RpcCompletion));
+    } break;
+    default: Unreachable("invalid completion kind"); break;
+    }
   }
+}
 
-  return 0;
+// Hands req to the handler pool, or runs it right here if there is none.
+// Queued requests keep the part of rbuf their payload lives in pinned.
+// Requests past their deadline (they may have been held back by rpc_client_throttle)
+// are answered with DeadlineExceeded without running.
+// compressed: req.data still has to go through rpc_payload_inflate.
+// inflight: the entry req is tracked under, NULL if it has no request ID. Responding removes it.
+function void
+rpc_client_dispatch(RpcClient *c, RpcRequest req, RpcHandler *hdlr, bool compressed, RpcInflight *inflight) {
+  RpcServer *srv = c->server;
+  RpcWorker *w   = c->worker;
+  rpc_worker_count_request(w, hdlr != NULL ? hdlr->metrics : (u32)srv->n_procs, req.data.len);
+  if (Unlikely(hdlr == NULL)) {
+    rpc_server_respond_status(srv, &req, RpcStatus_NotFound);
+    return;
+  }
+  if (req.deadline == 0 && hdlr->timeout_ms != 0) req.deadline = c->rtime + hdlr->timeout_ms;
+  if (req.deadline != 0 && req.deadline <= os_now_ms()) {
+    rpc_server_respond_status(srv, &req, RpcStatus_DeadlineExceeded);
+    return;
+  }
+  // Cancelling and negotiating compression work on client state, which only its I/O thread may touch.
+  bool on_io_thread = srv->pool.n_threads == 0 || (srv->pool.streaming_only && !hdlr->streaming);
+  if (on_io_thread || hdlr->f == rpc_cancel_handler || hdlr->f == rpc_compression_handler) {
+    // Responses are encoded right away on this thread, so nothing in scratch outlives the handler.
+    if (!compressed || rpc_payload_inflate(&w->scratch, req.data, &req.data)) {
+      TraceBegin("handler", req.request_id);
+      hdlr->f(srv, req, &w->scratch, hdlr->ctx);
+      TraceEnd("handler", req.request_id);
+    } else {
+      rpc_server_respond_status(srv, &req, RpcStatus_InvalidArgument);
+    }
+    mem_arena_clear(&w->scratch);
+    return;
+  }
+
+  // Before the rbuf ref: an unpinned ref left behind would make rbuf look shared.
+  RpcScratch *scratch = rpc_worker_acquire_scratch(w);
+  if (scratch == NULL) {
+    rpc_server_respond_status(srv, &req, RpcStatus_ResourceExhausted);
+    return;
+  }
+  if (c->rbuf_ref == NULL) {
+    c->rbuf_ref = mem_reserve_commit(srv->objs, sizeof(RpcRecvBufRef));
+    *c->rbuf_ref = (RpcRecvBufRef){ .mb = c->rbuf.mb, .items = c->rbuf.items, .cap = c->rbuf.cap };
+  }
+  RpcJob *job = mem_reserve_commit(srv->objs, sizeof(RpcJob));
+  *job = (RpcJob){
+    .done = { .kind = RpcCompletionKind_JobDone },
+    .req  = req,
+    .hdl  = *hdlr,
+    .buf  = c->rbuf_ref,
+    .scratch  = scratch,
+    .inflate  = compressed,
+    .compress = c->compress,
+  };
+  job->req.job = job;
+  semaphore_init(&job->stream_room, 0);
+  c->rbuf_ref->pins++;
+
+  if (!mpmc_push(&srv->pool.queue, job)) {
+    rpc_worker_unpin(w, job->buf, c->id);
+    rpc_worker_release_scratch(w, scratch);
+    mem_decommit_release(srv->objs, job, sizeof(RpcJob));
+    rpc_server_respond_status(srv, &req, RpcStatus_ResourceExhausted);
+    return;
+  }
+  c->job_bytes += req.data.len;
+  if (inflight != NULL) inflight->job = job;
+  if (req.deadline != 0) timer_arm(&w->timers, &job->deadline, req.deadline, rpc_job_expire, job);
+  semaphore_post(&srv->pool.ready);
 }
 
+// Fires on the I/O thread of the client when a job is still queued at its deadline.
+// The job itself stays around until the handler thread that pops it posts it back.
 function void
-rpc_request_destroy(RpcRequest req) {
-  SliceDestroy(req.data);
+rpc_job_expire(Timer *t, void *ctx) {
+  (void)t;
+  RpcJob *job = ctx;
+  u32 queued = RpcJobState_Queued;
+  if (__atomic_compare_exchange_n(&job->state, &queued, RpcJobState_Expired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    rpc_server_respond_status(rpc_current_worker->server, &job->req, RpcStatus_DeadlineExceeded);
 }
 
+// Runs the handler of job on the current handler thread. Compressed payloads are
+// decompressed into the scratch arena of the job first.
 function void
-rpc_server_respond(RpcServer *srv_, RpcResponse rsp_) {
-  (void)srv_; (void)rsp_;
+rpc_job_run(RpcServer *srv, RpcJob *job) {
+  RpcRequest req = job->req;
+  if (job->inflate && !rpc_payload_inflate(&job->scratch->arena, req.data, &req.data)) {
+    rpc_server_respond_status(srv, &req, RpcStatus_InvalidArgument);
+    return;
+  }
+  rpc_current_job = job;
+  TraceBegin("handler", req.request_id);
+  job->hdl.f(srv, req, &job->scratch->arena, job->hdl.ctx);
+  TraceEnd("handler", req.request_id);
+  rpc_current_job = NULL;
+}
+
+function void *
+rpc_pool_thread(void *ctx) {
+  RpcServer *srv = ctx;
+  TraceThreadName("handler");
+  while (true) {
+    semaphore_wait(&srv->pool.ready);
+    void *p;
+    // The job we were woken for has been pushed completely, but a producer that
+    // claimed an earlier cell may still be filling it in.
+    while (!mpmc_pop(&srv->pool.queue, &p)) {}
+    RpcJob *job = p;
+    u32 queued = RpcJobState_Queued;
+    if (__atomic_compare_exchange_n(&job->state, &queued, RpcJobState_Running, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      rpc_job_run(srv, job);
+    rpc_worker_post(&srv->workers[RpcClientIdWorker(job->req.client_id)], &job->done.node);
+  }
+  return NULL;
+}
+
+// vu64s are big endian groups of 7 bits, every byte but the last one has its high bit set.
+// Continues decoding a vu64 of which *n bytes have been accumulated into *x already,
+// *consumed is set to the number of bytes taken from bs.
+function RpcDecodeStatus
+try_read_vu64(String bs, u64 *x, u8 *n, usize *consumed) {
+  usize i = 0;
+  while (i < bs.len) {
+    u8 b = bs.buf[i++];
+    if (*n == RPC_VU64_MAX_LEN || (*x >> 57) != 0) {
+      *consumed = i;
+      return RpcDecodeStatus_Invalid; // doesn't fit in 64 bits
+    }
+    *x = (*x << 7) | (u64)(b & 0x7F);
+    (*n)++;
+    if ((b & 0x80) == 0) {
+      *consumed = i;
+      return RpcDecodeStatus_Done;
+    }
+  }
+  *consumed = i;
+  return RpcDecodeStatus_More;
 }
 
 function void
-rpc_server_handle(RpcServer *srv, RpcRequest req) {
-  for (usize i = 0; i < SliceLen(srv->handlers); i++) {
-    RpcHandler hdlr = srv->handlers.items[i];
-    if (hdlr.uid == req.uid) {
-      hdlr.f(srv, req, hdlr.ctx);
-      rpc_request_destroy(req);
-      return;
+rpc_client_next_field(RpcClient *c, RpcClientReadState next) {
+  c->rstate = next;
+  c->racc   = 0;
+  c->rlen   = 0;
+}
+
+// Parses and dispatches every complete request frame in rbuf. Payloads are handed
+// to the handlers in place. Returns false on a protocol error, which closes the client.
+function bool
+rpc_client_read(RpcClient *c) {
+  TraceBegin("parse", c->id);
+  while (true) {
+    if (c->rstate == RpcClientReadState_Body) {
+      usize payload_len = c->rreq.data.len;
+      if (SliceLen(c->rbuf) - c->rpos < payload_len) break;
+      if (rpc_client_throttle(c)) break; // stays buffered until the client resumes
+
+      RpcRequest req = c->rreq;
+      req.client_id  = c->id;
+      req.data       = string_from_raw(c->rbuf.items + c->rpos, payload_len);
+      bool compressed = c->rcompressed;
+      c->rcompressed  = false;
+      c->rpos  += payload_len;
+      c->rstart = c->rpos;
+      rpc_client_next_field(c, RpcClientReadState_Start);
+      RpcServer *srv = c->server;
+      if (req.uid == RPC_PROC_PING && srv->ping_inline) {
+        rpc_worker_count_request(c->worker, srv->ping_metrics, req.data.len);
+        if (req.request_id == 0) continue;
+        if (rpc_inflight_find(&c->inflight, req.request_id) != NULL) goto DuplicateId;
+        rpc_client_answer_ping(c, req.request_id);
+        // Answered synchronously: not worth reading the clock for.
+        rpc_worker_count_response(c->worker, srv->ping_metrics, RpcStatus_Ok, 0, 0);
+        continue;
+      }
+      RpcHandler *hdlr = rpc_dispatch_lookup(&srv->dispatch, req.uid);
+      RpcInflight *inflight = NULL;
+      if (req.request_id != 0) {
+        RpcInflight e = {
+          .request_id = req.request_id,
+          .started    = os_now_ns(),
+          .metrics    = hdlr != NULL ? hdlr->metrics : (u32)srv->n_procs,
+        };
+        inflight = rpc_inflight_insert(c->worker->mb, &c->inflight, e);
+        if (inflight == NULL) goto DuplicateId;
+      }
+      TraceBegin("dispatch", req.request_id);
+      rpc_client_dispatch(c, req, hdlr, compressed, inflight);
+      TraceEnd("dispatch", req.request_id);
+      continue;
+    }
+
+    if (c->rpos == SliceLen(c->rbuf)) break;
+    String avail = string_from_raw(c->rbuf.items + c->rpos, SliceLen(c->rbuf) - c->rpos);
+    usize consumed = 0;
+    RpcDecodeStatus ds = RpcDecodeStatus_More;
+
+    switch (c->rstate) {
+    case RpcClientReadState_Start:
+      if (avail.buf[0] == RPC_COMPRESSED_MARKER && !c->rcompressed) {
+        c->rcompressed = true;
+        c->rpos++;
+        break;
+      }
+      if (avail.buf[0] != RPC_REQUEST_MARKER && avail.buf[0] != RPC_REQUEST_DEADLINE_MARKER) goto Invalid;
+      c->rtimed = avail.buf[0] == RPC_REQUEST_DEADLINE_MARKER;
+      c->rreq.deadline = 0;
+      c->rpos++;
+      rpc_client_next_field(c, RpcClientReadState_ProcedureId);
+      break;
+    case RpcClientReadState_ProcedureId:
+      while (consumed < avail.len && c->rlen < sizeof(u64)) {
+        c->racc = (c->racc << 8) | avail.buf[consumed++];
+        c->rlen++;
+      }
+      c->rpos += consumed;
+      if (c->rlen == sizeof(u64)) {
+        c->rreq.uid = c->racc;
+        rpc_client_next_field(c, RpcClientReadState_ResponseId);
+      }
+      break;
+    case RpcClientReadState_ResponseId:
+      ds = try_read_vu64(avail, &c->racc, &c->rlen, &consumed);
+      c->rpos += consumed;
+      if (ds == RpcDecodeStatus_Invalid) goto Invalid;
+      if (ds == RpcDecodeStatus_Done) {
+        c->rreq.request_id = c->racc;
+        rpc_client_next_field(c, c->rtimed ? RpcClientReadState_Timeout : RpcClientReadState_PayloadLength);
+      }
+      break;
+    case RpcClientReadState_Timeout:
+      ds = try_read_vu64(avail, &c->racc, &c->rlen, &consumed);
+      c->rpos += consumed;
+      if (ds == RpcDecodeStatus_Invalid) goto Invalid;
+      if (ds == RpcDecodeStatus_Done) {
+        if (c->racc != 0) c->rreq.deadline = c->rtime + Min(c->racc, (u64)U32_MAX);
+        rpc_client_next_field(c, RpcClientReadState_PayloadLength);
+      }
+      break;
+    case RpcClientReadState_PayloadLength:
+      ds = try_read_vu64(avail, &c->racc, &c->rlen, &consumed);
+      c->rpos += consumed;
+      if (ds == RpcDecodeStatus_Invalid || (ds == RpcDecodeStatus_Done && c->racc > RPC_MAX_PAYLOAD)) goto Invalid;
+      if (ds == RpcDecodeStatus_Done) {
+        c->rreq.data = string_from_raw(NULL, (usize)c->racc);
+        rpc_client_next_field(c, RpcClientReadState_Body);
+        // Make room for the whole payload now, so it lands without any further regrowth.
+        usize end = c->rpos + c->rreq.data.len;
+        if (end > SliceLen(c->rbuf)) rpc_client_rbuf_reserve(c, end - SliceLen(c->rbuf));
+      }
+      break;
+    case RpcClientReadState_Body: Unreachable("handled above"); break;
+    default: Unreachable("invalid read state"); break;
     }
   }
-  RpcResponse rsp = {
-    .code = 5, /* not found */
-    .data = SliceNew(u8, srv->mb),
-    .client_id  = req.client_id,
-    .request_id = req.request_id,
-  };
-  rpc_server_respond(srv, rsp);
+
+  // Common case: everything has been dispatched, start over without moving anything.
+  if (c->rstart == SliceLen(c->rbuf) && !rpc_client_rbuf_pinned(c)) {
+    c->rbuf.len = 0;
+    c->rstart   = 0;
+    c->rpos     = 0;
+  }
+  TraceEnd("parse", c->id);
+  return true;
+
+Invalid:
+  puts("Protocol error: malformed request frame");
+  goto Fail;
+
+DuplicateId:
+  puts("Protocol error: response ID is already in flight");
+
+Fail:
+  TraceEnd("parse", c->id);
+  rpc_client_close(c);
+  return false;
 }
 
-function s32
-try_read_vu64(Slice(u8) bs) {
-  u64 x = 0;
-  bool ended = false;
-  for (usize i = 0; i < bs.len; i++) {
-    u8 b = $(bs, i);
-    ended = b & 0x80;
-    x = (u64)(x << 7) | (u64)(b & ~0x80);
-    if (ended) break;
+function RpcInflight *
+rpc_inflight_find(RpcInflightTable *t, u64 request_id) {
+  if (t->entries == NULL) return NULL;
+  usize mask = ((usize)1 << t->shift) - 1;
+  for (usize i = rpc_hash_u64(request_id, t->shift);; i = (i + 1) & mask) {
+    RpcInflight *e = &t->entries[i];
+    if (e->request_id == 0)          return NULL;
+    if (e->request_id == request_id) return e;
   }
-  if (!ended) return -1; // need more data
 }
 
 function void
-rpc_client_read(RpcClient *c, Slice(u8) data) {
-  SliceExtend(&c->rbuf, data);
-  switch (c->rstate) {
-  case RpcClientReadState_Start:
-    if (SliceLen(c->rbuf) < 3) {
-      // Not a valid request or response
-      return;
+rpc_inflight_place(RpcInflightTable *t, RpcInflight e) {
+  usize mask = ((usize)1 << t->shift) - 1;
+  usize i = rpc_hash_u64(e.request_id, t->shift);
+  while (t->entries[i].request_id != 0) i = (i + 1) & mask;
+  t->entries[i] = e;
+}
+
+function void
+rpc_inflight_grow(Mem_Base *mb, RpcInflightTable *t) {
+  RpcInflightTable old = *t;
+  t->shift = old.entries == NULL ? RPC_INFLIGHT_MIN_SHIFT : (u8)(old.shift + 1);
+  usize size = ((usize)1 << t->shift) * sizeof(RpcInflight);
+  t->entries = mem_reserve_commit(mb, size);
+  memset(t->entries, 0, size);
+  if (old.entries == NULL) return;
+  for (usize i = 0; i < ((usize)1 << old.shift); i++) {
+    if (old.entries[i].request_id != 0) rpc_inflight_place(t, old.entries[i]);
+  }
+  mem_decommit_release(mb, old.entries, ((usize)1 << old.shift) * sizeof(RpcInflight));
+}
+
+// Returns NULL if a request with the same response ID is already in flight.
+function RpcInflight *
+rpc_inflight_insert(Mem_Base *mb, RpcInflightTable *t, RpcInflight e) {
+  Assert(e.request_id != 0);
+  if (rpc_inflight_find(t, e.request_id) != NULL) return NULL;
+  // Keep the load factor at or below 1/2.
+  if (t->entries == NULL || (t->len + 1) * 2 > ((usize)1 << t->shift))
+    rpc_inflight_grow(mb, t);
+  rpc_inflight_place(t, e);
+  t->len++;
+  return rpc_inflight_find(t, e.request_id);
+}
+
+// Backward shift deletion: no tombstones, so lookups never get slower over the
+// lifetime of a (persistent) connection.
+function void
+rpc_inflight_remove(RpcInflightTable *t, RpcInflight *e) {
+  usize mask = ((usize)1 << t->shift) - 1;
+  usize hole = (usize)(e - t->entries);
+  for (usize i = (hole + 1) & mask; t->entries[i].request_id != 0; i = (i + 1) & mask) {
+    usize home = rpc_hash_u64(t->entries[i].request_id, t->shift);
+    // Move entry i into the hole if the hole lies on its probe path (between home and i).
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      t->entries[hole] = t->entries[i];
+      hole = i;
     }
-  case RpcClientReadState_Body: break;
-  default: break;
   }
+  t->entries[hole] = (RpcInflight){0};
+  t->len--;
+}
+
+function void
+rpc_inflight_destroy(Mem_Base *mb, RpcInflightTable *t) {
+  if (t->entries != NULL)
+    mem_decommit_release(mb, t->entries, ((usize)1 << t->shift) * sizeof(RpcInflight));
+  *t = (RpcInflightTable){0};
 }
 
+// Must be called before run_rpc_server.
 function void
 rpc_server_reg_handler(RpcServer *srv, RpcHandler hdl) {
-  SliceAppend(&srv->handlers, hdl);
-  RpcRequest req = {
-    .uid  = 1293408,
-    .data = SliceNew(u8, srv->mb),
-    .client_id  = 0,
-    .request_id = 0,
-  };
-  rpc_server_handle(srv, req);
+  if (srv->dispatch.frozen) {
+    fputs("Error: handlers can't be registered while the server is running\n", stderr);
+    return;
+  }
+  rpc_dispatch_insert(srv->mb, &srv->dispatch, hdl);
+  if (hdl.streaming) srv->streaming = true;
 }
 
 function RpcHandler
@@ -208,15 +2271,17 @@ slice_next_cap(usize want_len) {
 #if IsCompiler(COMPILER_GCC) || IsCompiler(COMPILER_CLANG)
   // This if statement should be evaluated at compile-time.
   if (sizeof(usize) == 8) {
-    s32 leading_zeros = __builtin_clzll((u64)want_len);
+    if (want_len == 1) return 1;
+    s32 leading_zeros = __builtin_clzll((u64)want_len - 1);
     if (Unlikely(leading_zeros == 0))
       return USIZE_MAX;
-    return (usize)1 << (63 - leading_zeros);
+    return (usize)1 << (64 - leading_zeros);
   } else if (sizeof(usize) == 4) {
-    s32 leading_zeros = __builtin_clz((u32)want_len);
+    if (want_len == 1) return 1;
+    s32 leading_zeros = __builtin_clz((u32)want_len - 1);
     if (Unlikely(leading_zeros == 0))
       return USIZE_MAX;
-    return (usize)1 << (31 - leading_zeros);
+    return (usize)1 << (32 - leading_zeros);
   }
 #else
   usize cap = 1;
@@ -231,14 +2296,24 @@ slice_next_cap(usize want_len) {
 function void
 slice_grow_for(usize new_len, usize *len, usize *cap, Mem_Base *mb, void **items, usize item_size) {
   usize new_cap = slice_next_cap(new_len);
-  void *new_items = mem_reserve(mb, item_size * new_cap);
+  // Bases that can grow blocks in place save the copy, and pointers into items stay valid.
+  if (mb != NULL && *items != NULL && mem_grow(mb, *items, item_size * *cap, item_size * new_cap)) {
+    *cap = new_cap;
+    return;
+  }
+  void *new_items = mb != NULL ? mem_reserve(mb, item_size * new_cap) : NULL;
+  if (new_items == NULL) {
+    // Out of memory, a reserved slice outgrowing its reservation, or one that never got any.
+    fprintf(stderr, "Error: can't grow a slice to %zu items of %zu bytes\n", new_cap, item_size);
+    abort();
+  }
   mem_commit(mb, new_items, item_size * new_cap);
-  memmove(new_items, *items, item_size * *len);
   if (*items != NULL) {
+    memmove(new_items, *items, item_size * *len);
     mem_decommit_release(mb, *items, item_size * *cap);
   }
   *items = new_items;
-  *cap *= new_cap;
+  *cap = new_cap;
 }
 
 function void
@@ -250,3 +2325,134 @@ function void
 slice_destroy(usize cap, Mem_Base *mb, void *items, usize item_size) {
   mem_decommit_release(mb, items, cap * item_size);
 }
+
+function s32
+rpc_session_cache_init(RpcSessionCache *sc, Mem_Base *mb, usize capacity, time_t timeout) {
+  usize per_shard = capacity / (RPC_SESSION_CACHE_SHARDS * RPC_SESSION_CACHE_WAYS);
+  usize n_sets    = slice_next_cap(ClampBot(per_shard, 1));
+  *sc = (RpcSessionCache){ .mb = mb, .timeout = timeout };
+  while (((usize)1 << sc->set_bits) < n_sets) sc->set_bits++;
+  for (usize i = 0; i < RPC_SESSION_CACHE_SHARDS; i++) {
+    RpcSessionShard *sh = &sc->shards[i];
+    s32 s = mutex_init(&sh->lock);
+    if (s != 0) return s;
+    usize size = n_sets * RPC_SESSION_CACHE_WAYS * sizeof(RpcSessionEntry);
+    sh->entries = mem_reserve_commit(mb, size);
+    memset(sh->entries, 0, size);
+  }
+  return 0;
+}
+
+// Session IDs are random, so any eight bytes of them make a good key.
+function RpcSessionEntry *
+rpc_session_cache_set_of(RpcSessionCache *sc, const u8 *id, usize id_len, RpcSessionShard **shard) {
+  u64 key = 0;
+  memcpy(&key, id, Min(id_len, sizeof(key)));
+  usize h = rpc_hash_u64(key, (u8)(5 + sc->set_bits)); // 5 == log2(RPC_SESSION_CACHE_SHARDS)
+  *shard = &sc->shards[h >> sc->set_bits];
+  return &(*shard)->entries[(h & (((usize)1 << sc->set_bits) - 1)) * RPC_SESSION_CACHE_WAYS];
+}
+
+function bool
+rpc_session_entry_matches(RpcSessionEntry *e, const u8 *id, usize id_len) {
+  return e->created != 0 && e->id_len == id_len && memcmp(e->id, id, id_len) == 0;
+}
+
+// mbedtls_ssl_conf_session_cache get callback: fills in session if its ID is cached.
+// Depending on the mbedtls version, session is either a fresh one holding just the ID
+// (and mbedtls compares what's loaded with what it negotiated), or the session being
+// negotiated, with the ciphersuite and compression picked for this handshake already
+// set and resumed as is. In that case a session cached with others has to be a miss,
+// so the handshake falls back to a full one. Ciphersuite 0 is never negotiated.
+// The blob is loaded into a session of its own: a failed load frees and wipes the
+// session it loads into.
+function int
+rpc_session_cache_get(void *ctx, mbedtls_ssl_session *session) {
+  RpcSessionCache *sc = ctx;
+  RpcWorker *w = rpc_current_worker;
+  if (session->id_len == 0 || session->id_len > sizeof(((RpcSessionEntry *)0)->id)) return 1;
+
+  mbedtls_ssl_session loaded;
+  mbedtls_ssl_session_init(&loaded);
+  s32 s = 1;
+  {
+    RpcSessionShard *sh;
+    RpcSessionEntry *set = rpc_session_cache_set_of(sc, session->id, session->id_len, &sh);
+    MutexLockScoped(&sh->lock);
+    time_t now = time(NULL);
+    for (usize i = 0; i < RPC_SESSION_CACHE_WAYS; i++) {
+      RpcSessionEntry *e = &set[i];
+      if (!rpc_session_entry_matches(e, session->id, session->id_len)) continue;
+      if (now - e->created > sc->timeout) {
+        e->created = 0;
+      } else if (session->ciphersuite == 0 ||
+                 (e->ciphersuite == session->ciphersuite && e->compression == session->compression)) {
+        s = mbedtls_ssl_session_load(&loaded, e->blob, e->blob_len);
+      }
+      break;
+    }
+  }
+  if (s == 0) {
+    mbedtls_ssl_session_free(session);
+    *session = loaded; // takes over what loaded owns
+  }
+  if (w != NULL) {
+    if (s == 0) RpcStatInc(w->tls_stats.cache_hits);
+    else        RpcStatInc(w->tls_stats.cache_misses);
+  }
+  return s == 0 ? 0 : 1;
+}
+
+// mbedtls_ssl_conf_session_cache set callback: stores session under its ID,
+// evicting the oldest entry of the set if it is full.
+function int
+rpc_session_cache_set(void *ctx, const mbedtls_ssl_session *session) {
+  RpcSessionCache *sc = ctx;
+  if (session->id_len == 0 || session->id_len > sizeof(((RpcSessionEntry *)0)->id)) return 1;
+
+  usize size = 0;
+  s32 s = mbedtls_ssl_session_save(session, NULL, 0, &size);
+  if (s != MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL) return s != 0 ? s : 1;
+
+  RpcSessionShard *sh;
+  RpcSessionEntry *set = rpc_session_cache_set_of(sc, session->id, session->id_len, &sh);
+  MutexLockScoped(&sh->lock);
+  RpcSessionEntry *e = &set[0];
+  for (usize i = 0; i < RPC_SESSION_CACHE_WAYS; i++) {
+    if (rpc_session_entry_matches(&set[i], session->id, session->id_len)) {
+      e = &set[i];
+      break;
+    }
+    if (set[i].created < e->created) e = &set[i];
+  }
+
+  if (e->blob_cap < size) {
+    if (e->blob != NULL) mem_decommit_release(sc->mb, e->blob, e->blob_cap);
+    e->blob     = mem_reserve_commit(sc->mb, size);
+    e->blob_cap = size;
+  }
+  s = mbedtls_ssl_session_save(session, e->blob, e->blob_cap, &e->blob_len);
+  if (s != 0) {
+    e->created = 0;
+    return s;
+  }
+  e->created     = time(NULL);
+  e->ciphersuite = session->ciphersuite;
+  e->compression = session->compression;
+  e->id_len      = (u8)session->id_len;
+  memcpy(e->id, session->id, session->id_len);
+  return 0;
+}
+
+// Counts ticket resumptions on top of mbedtls_ssl_ticket_parse. mbedtls doesn't call
+// this for empty tickets, so every call is a client trying to resume.
+function int
+rpc_ticket_parse(void *ctx, mbedtls_ssl_session *session, unsigned char *buf, size_t len) {
+  int s = mbedtls_ssl_ticket_parse(ctx, session, buf, len);
+  RpcWorker *w = rpc_current_worker;
+  if (w != NULL) {
+    if (s == 0) RpcStatInc(w->tls_stats.ticket_hits);
+    else        RpcStatInc(w->tls_stats.ticket_misses);
+  }
+  return s;
+}
@@ -5,8 +5,10 @@
 # include <immintrin.h>
 #endif
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #if OsHasFlags(OS_FLAGS_POSIX)
 # include <arpa/inet.h>
@@ -16,6 +18,13 @@
 # include <unistd.h>
 #endif
 
+#if IsOs(OS_LINUX)
+# include <linux/tls.h>
+# include <netinet/tcp.h>
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+#endif
+
 #include <mbedtls/entropy.h>
 #include <mbedtls/ctr_drbg.h>
 #include <mbedtls/x509.h>
@@ -24,7 +33,26 @@
 #include <mbedtls/error.h>
 #include <mbedtls/error.h>
 #include <mbedtls/debug.h>
-#include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/platform_util.h>
+
+// What mbedtls allocates is counted under Mem_Tag_Tls, if it lets us swap its allocator.
+#if defined(MBEDTLS_PLATFORM_MEMORY) && !defined(MBEDTLS_PLATFORM_CALLOC_MACRO) && !defined(MBEDTLS_PLATFORM_FREE_MACRO)
+# include <mbedtls/platform.h>
+# define RPC_TLS_MEM_HOOKS 1
+#else
+# define RPC_TLS_MEM_HOOKS 0
+#endif
+
+// kTLS needs the traffic keys, which mbedtls only hands out with MBEDTLS_SSL_EXPORT_KEYS.
+#if IsOs(OS_LINUX) && defined(MBEDTLS_SSL_EXPORT_KEYS) && defined(TLS_CIPHER_AES_GCM_256)
+# define RPC_KTLS_AVAILABLE 1
+# if !defined(SOL_TLS)
+#  define SOL_TLS 282
+# endif
+#else
+# define RPC_KTLS_AVAILABLE 0
+#endif
 
 function usize slice_next_cap(usize want_len);
 function void  slice_grow(usize *len, usize *cap, Mem_Base *mb, void **items, usize item_size);
@@ -34,6 +62,12 @@ function void  slice_destroy(usize cap, Mem_Base *mb, void *items, usize item_si
 #define DefSlice(t) struct Glue(Slice_, t) { usize len; usize cap; Mem_Base *mb; t *items; }
 #define Slice(t) struct Glue(Slice_, t)
 #define SliceNew(t, membase) (Slice(t)){ .len = 0, .cap = 0, .mb = (membase), .items = NULL }
+// Items of a reserved slice never move: they grow in place, in address space reserved up
+// front, with pages committed as they're needed. The reservation is a hard limit: growing
+// past max_len items (rounded up to a power of two, then to whole commit granules) aborts.
+// SliceDestroy gives it back. If the address space can't be reserved, mb is NULL: check
+// for that before using the slice.
+#define SliceNewReserved(t, max_len, tag) SliceNew(t, mem_reserved_base(slice_next_cap(max_len) * sizeof(t), (tag)))
 #define SliceNewWithCap(t, membase, cap) (Slice(t)){ .len = 0, .cap = (cap), .mb = (membase), .items = mem_reserve_commit((membase), cap * sizeof(t)) }
 #define SliceDestroy(s) slice_destroy((s).cap, (s).mb, (s).items, sizeof(*(s).items))
 #define $(s, i) ((s).items[((i) >= (s).len) ? (*(usize *)Unreachable("index out of bounds")) : (i)])
@@ -49,70 +83,618 @@ function void  slice_destroy(usize cap, Mem_Base *mb, void *items, usize item_si
     (sp)->items[(sp)->len] = (s).items[0]; /* make sure the types are equal */                                            \
     memmove(&(sp)->items[(sp)->len], (s).items, sizeof(*(s).items) * (s).len);                                            \
   } while (false)
+#define SliceReserve(sp, n) do {                                                                                    \
+    if ((sp)->len + (n) > (sp)->cap)                                                                              \
+      slice_grow_for((sp)->len + (n), &(sp)->len, &(sp)->cap, (sp)->mb, (void **)&(sp)->items, sizeof(*(sp)->items)); \
+  } while (false)
 #define SliceLen(s) (s).len
+#define SliceSpare(s) ((s).cap - (s).len)
 
 struct RpcServer;
 
+#define XM_RPC_STATUSES \
+  X(Ok,                  0) \
+  X(Cancelled,           1) \
+  X(Unknown,             2) \
+  X(InvalidArgument,     3) \
+  X(DeadlineExceeded,    4) \
+  X(NotFound,            5) \
+  X(AlreadyExists,       6) \
+  X(PermissionDenied,    7) \
+  X(ResourceExhausted,   8) \
+  X(FailedPrecondition,  9) \
+  X(Aborted,            10) \
+  X(OutOfRange,         11) \
+  X(Unimplemented,      12) \
+  X(Internal,           13) \
+  X(Unavailable,        14) \
+  X(DataLoss,           15)
+
+typedef enum RpcStatus {
+#define X(name, code) Glue(RpcStatus_, name) = code,
+  XM_RPC_STATUSES
+#undef X
+} RpcStatus;
+
+// Status byte of every frame of a streamed response but the last one. The last frame
+// is an ordinary response, which ends the stream (see rpc_server_stream).
+#define RPC_STATUS_STREAM_CHUNK 0xFF
+
+// Prefixes a request or response frame whose payload is compressed, see RPC.md.
+#define RPC_COMPRESSED_MARKER 0xFD
+
+// Codecs, as bits of the payload of the compression procedure.
+#define RPC_COMPRESSION_LZ 0x01 // lz_compress
+
+// Response family IDs 0-127 select a nested response family,
+// 1xxx_xxxx selects the field for status xxx_xxxx of the response itself.
+#define RpcFamilyStatus(code) ((u8)(0x80 | (code)))
+
 DefSlice(u8);
+DefSlice(u64);
+DefSlice(usize);
 typedef struct RpcResponse {
   u64 client_id;
   u64 request_id;
   u8  code;
-  Slice(u8) data;
+  u8  family;
+  Slice(u8) data; // owned by the response, rpc_server_respond destroys it
 } RpcResponse;
 
 typedef struct RpcRequest {
   u64 uid;
   u64 client_id;
   u64 request_id;
-  Slice(u8) data;
+  u64 deadline; // os_now_ms() time after which the client has given up, 0 if none
+  // Points into the receive buffer of the client, only valid until the handler returns.
+  String data;
+  // The job running the request on a handler thread, NULL for requests handled on the
+  // I/O thread. See rpc_request_cancelled and rpc_server_stream. Only valid until the handler returns.
+  struct RpcJob *job;
 } RpcRequest;
 
-typedef void RpcHandlerFunc(struct RpcServer *srv, RpcRequest req, void *ctx);
+// scratch is for anything the handler needs only while handling req, including the data
+// of the response to req if it's sent before returning. It's cleared (all at once) after the handler
+// returns and whatever it responded with has been copied out for sending, so handlers
+// answering later on must allocate the response data elsewhere (e.g. from srv->mb).
+typedef void RpcHandlerFunc(struct RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx);
+
+// Least address space a scratch arena reserves (see RpcServerConfig.scratch_reserve).
+// A decompressed payload goes in there too, so it has to be well over RPC_MAX_PAYLOAD.
+#define RPC_SCRATCH_MIN_RESERVE (2 * RPC_MAX_PAYLOAD)
+
+// Built-in procedures, see RPC.md.
+#define RPC_PROC_PING    0x00
+#define RPC_PROC_METRICS 0x01
+#define RPC_PROC_TRACE   0x02 // only with ENABLE_TRACE
+#define RPC_PROC_CANCEL  0x03
+#define RPC_PROC_COMPRESSION 0x04
 
 typedef struct RpcHandler {
   u64 uid;
   RpcHandlerFunc *f;
   void *ctx;
+  u32 timeout_ms; // deadline for requests that don't carry one, 0 means none
+  u32 metrics;    // index of its RpcProcMetrics, assigned by run_rpc_server
+  bool streaming; // calls rpc_server_stream, so it always runs on a handler thread
 } RpcHandler;
-DefSlice(RpcHandler);
+
+// Open addressing (linear probing) hash table of handlers keyed by procedure ID.
+// Entries are padded to half a cache line and the table is cache line aligned,
+// so a lookup that stays within its home line touches exactly one line.
+typedef struct RpcDispatchEntry {
+  _Alignas(32) RpcHandler hdl; // hdl.f == NULL marks a free entry
+} RpcDispatchEntry;
+
+#define RPC_DISPATCH_ENTRIES_PER_LINE (CACHE_LINE_SIZE / sizeof(RpcDispatchEntry))
+#define RPC_DISPATCH_MIN_SHIFT 3
+// Upper bound on how far rpc_dispatch_freeze spreads out the table (as a power of two
+// factor over the minimum size) trying to give every handler its home cache line.
+#define RPC_DISPATCH_MAX_SPREAD 3
+
+typedef struct RpcDispatchTable {
+  RpcDispatchEntry *entries;
+  void  *mem;      // unaligned allocation backing entries
+  usize  mem_size;
+  u8     shift;    // log2 of the number of entries
+  usize  len;
+  bool   frozen;
+} RpcDispatchTable;
+
+function usize       rpc_hash_u64(u64 x, u8 shift);
+function RpcHandler *rpc_dispatch_lookup(RpcDispatchTable *t, u64 uid);
+function void        rpc_dispatch_insert(Mem_Base *mb, RpcDispatchTable *t, RpcHandler hdl);
+function void        rpc_dispatch_freeze(Mem_Base *mb, RpcDispatchTable *t);
 
 struct RpcServer;
 
+// Request: FF <procedure ID, u64> <response ID, vu64> <payload length, vu64> <payload>
+//      or: FE <procedure ID, u64> <response ID, vu64> <timeout in ms, vu64> <payload length, vu64> <payload>
 typedef enum RpcClientReadState {
   RpcClientReadState_Start,
+  RpcClientReadState_ProcedureId,
+  RpcClientReadState_ResponseId,
+  RpcClientReadState_Timeout,
+  RpcClientReadState_PayloadLength,
   RpcClientReadState_Body,
 } RpcClientReadState;
 
+#define RPC_REQUEST_MARKER          0xFF
+#define RPC_REQUEST_DEADLINE_MARKER 0xFE
+#define RPC_VU64_MAX_LEN   10
+#define RPC_MAX_PAYLOAD    ((usize)16 << 20)
+
+typedef enum RpcDecodeStatus {
+  RpcDecodeStatus_More,
+  RpcDecodeStatus_Done,
+  RpcDecodeStatus_Invalid,
+} RpcDecodeStatus;
+
+function RpcDecodeStatus try_read_vu64(String bs, u64 *x, u8 *n, usize *consumed);
+function usize           write_vu64(u8 *dest, u64 x);
+
+typedef enum RpcClientState {
+  RpcClientState_Handshake,
+  RpcClientState_Open,
+} RpcClientState;
+
+// In-flight requests of a client, keyed by response ID. Handlers may respond in any
+// order (or later, from elsewhere); responses are matched against this table and
+// written as soon as they're ready. Fire-and-forget requests (response ID 00) are never in here.
+typedef struct RpcInflight {
+  u64 request_id; // 0 marks a free entry
+  u64 started;    // os_now_ns() when it was dispatched
+  u32 metrics;    // index of the RpcProcMetrics of its procedure
+  struct RpcJob *job; // while it's queued for or running on a handler thread
+} RpcInflight;
+
+#define RPC_INFLIGHT_MIN_SHIFT 3
+
+typedef struct RpcInflightTable {
+  RpcInflight *entries;
+  u8    shift;
+  usize len;
+} RpcInflightTable;
+
+function RpcInflight *rpc_inflight_find(RpcInflightTable *t, u64 request_id);
+function RpcInflight *rpc_inflight_insert(Mem_Base *mb, RpcInflightTable *t, RpcInflight e);
+function void         rpc_inflight_remove(RpcInflightTable *t, RpcInflight *e);
+function void         rpc_inflight_destroy(Mem_Base *mb, RpcInflightTable *t);
+
+// Client IDs are unique across the whole server:
+// bits 48..63 hold the owning worker, bits 24..47 a per-worker generation counter
+// (so stale IDs never match a reused slot) and bits 0..23 the slot in RpcWorker.clients.
+#define RPC_CLIENT_SLOT_BITS 24
+#define RPC_CLIENT_GEN_BITS  24
+#define RpcClientIdMake(worker, gen, slot) \
+  (((u64)(worker) << (RPC_CLIENT_SLOT_BITS + RPC_CLIENT_GEN_BITS)) | \
+   (((u64)(gen) & ((1ull << RPC_CLIENT_GEN_BITS) - 1)) << RPC_CLIENT_SLOT_BITS) | (u64)(slot))
+#define RpcClientIdWorker(id) ((usize)((id) >> (RPC_CLIENT_SLOT_BITS + RPC_CLIENT_GEN_BITS)))
+#define RpcClientIdSlot(id)   ((usize)((id) & ((1ull << RPC_CLIENT_SLOT_BITS) - 1)))
+
+struct RpcWorker;
+
+// Connection buffers start out as (and, when idle, are returned as) fixed-size chunks
+// kept on a per-worker free list, so connection churn doesn't turn into allocator
+// traffic. Buffers that had to grow past a chunk go back to the memory base.
+#define RPC_BUF_CHUNK (16 << 10)
+
+typedef struct RpcBufChunk {
+  struct RpcBufChunk *next;
+} RpcBufChunk;
+
+typedef struct RpcBufPoolStats {
+  u64 hits;    // chunks taken from the free list
+  u64 misses;  // chunks allocated because the free list was empty
+  u64 returns; // chunks put back on the free list
+  u64 drops;   // chunks released because the free list was full
+} RpcBufPoolStats;
+
+// Only touched by the owning worker; the stats may be read from any thread.
+// Buffers allocate through mb, which adds what they hold to a counter shared by all
+// workers, so the server can cap its total buffer memory. Idle chunks on the free list
+// don't count against the cap (there are at most max_free of them).
+typedef struct RpcBufPool {
+  Mem_Base     mb;
+  Mem_Base    *backing;
+  usize       *used;
+  RpcBufChunk *free;
+  usize        n_free;
+  usize        max_free;
+  RpcBufPoolStats stats;
+} RpcBufPool;
+
+function void rpc_buf_pool_init(RpcBufPool *p, Mem_Base *backing, usize *used, usize max_free);
+function void rpc_buf_pool_acquire(RpcBufPool *p, Slice(u8) *buf);
+function void rpc_buf_pool_release(RpcBufPool *p, Mem_Base *mb, u8 *items, usize cap);
+function void rpc_buf_reserve(RpcBufPool *p, Slice(u8) *buf, usize n);
+
+// Sessions are cached in a fixed number of independently locked shards, so handshakes on
+// different workers rarely contend. Within a shard the session ID picks a set of
+// RPC_SESSION_CACHE_WAYS entries, which is all a lookup ever compares against.
+// Entries hold sessions serialized with mbedtls_ssl_session_save.
+#define RPC_SESSION_CACHE_SHARDS 32
+#define RPC_SESSION_CACHE_WAYS   4
+
+typedef struct RpcSessionEntry {
+  time_t created; // 0 for free entries
+  u8     id_len;
+  u8     id[32];
+  // Of the cached session. Older mbedtls resumes whatever the get callback loads, without
+  // checking it against the ciphersuite it just picked, so the callback has to.
+  int    ciphersuite;
+  int    compression;
+  u8    *blob;
+  usize  blob_len;
+  usize  blob_cap;
+} RpcSessionEntry;
+
+typedef struct RpcSessionShard {
+  _Alignas(CACHE_LINE_SIZE) Mutex lock;
+  RpcSessionEntry *entries; // n_sets * RPC_SESSION_CACHE_WAYS
+} RpcSessionShard;
+
+typedef struct RpcSessionCache {
+  Mem_Base *mb;
+  RpcSessionShard shards[RPC_SESSION_CACHE_SHARDS];
+  u8     set_bits; // log2 of the number of sets per shard
+  time_t timeout;
+} RpcSessionCache;
+
+function s32 rpc_session_cache_init(RpcSessionCache *sc, Mem_Base *mb, usize capacity, time_t timeout);
+function int rpc_session_cache_get(void *ctx, mbedtls_ssl_session *session);
+function int rpc_session_cache_set(void *ctx, const mbedtls_ssl_session *session);
+function int rpc_ticket_parse(void *ctx, mbedtls_ssl_session *session, unsigned char *buf, size_t len);
+
+// Counted per worker, summed by rpc_server_tls_stats. Every cache or ticket hit
+// is a handshake that skipped the key exchange.
+typedef struct RpcTlsStats {
+  u64 handshakes;
+  u64 cache_hits;
+  u64 cache_misses;
+  u64 ticket_hits;
+  u64 ticket_misses;
+  u64 ktls_offloads; // connections with at least one direction handled by the kernel
+} RpcTlsStats;
+
+// Per procedure, per worker. Only the worker writes to its own slots (nothing is shared
+// between threads, so no atomic read-modify-writes) and readers add up all workers'.
+// Requests are counted when they're dispatched, responses and latency (dispatch to
+// response, as seen by the I/O thread) when the response is queued for writing.
+#define RPC_METRICS_STATUSES        16 // responses with other codes count as Unknown
+#define RPC_METRICS_LATENCY_BUCKETS 24 // bucket i counts latencies under 2^i us, the last one the rest
+
+typedef struct RpcProcMetrics {
+  _Alignas(CACHE_LINE_SIZE) u64 requests;
+  u64 request_bytes;
+  u64 response_bytes;
+  u64 responses[RPC_METRICS_STATUSES];
+  u64 latency[RPC_METRICS_LATENCY_BUCKETS];
+  u64 latency_ns; // sum
+} RpcProcMetrics;
+
+typedef struct RpcReapStats {
+  u64 idle;       // open connections closed for receiving nothing for idle_timeout_ms
+  u64 handshakes; // connections closed for not completing the handshake in handshake_timeout_ms
+  u64 bytes;      // memory those connections held when they were closed, see rpc_client_footprint
+} RpcReapStats;
+
+// AES-GCM traffic keys of a connection, kept from the moment mbedtls derives them
+// until the handshake is done and they're either given to the kernel or wiped.
+typedef struct RpcKtlsKeys {
+  usize key_len; // 16 or 32
+  u8    client_key[32];
+  u8    server_key[32];
+  u8    client_salt[4];
+  u8    server_salt[4];
+} RpcKtlsKeys;
+
+// Tracks a receive buffer whose payloads are being read by handler threads.
+// While pinned, the I/O thread never moves or reuses the memory; if it needs room it
+// retires the buffer instead (and starts a new one), leaving it to be released when
+// the last handler using it is done. Only ever touched by the owning I/O thread.
+typedef struct RpcRecvBufRef {
+  Mem_Base *mb;
+  u8   *items;
+  usize cap;
+  u32   pins;
+  bool  retired;
+} RpcRecvBufRef;
+
 typedef struct RpcClient {
   u64 id;
   mbedtls_net_context fd;
+  mbedtls_ssl_context ssl;
   struct RpcServer *server;
+  struct RpcWorker *worker;
+  RpcClientState state;
+  RpcKtlsKeys *ktls_keys; // only during the handshake
+  bool ktls_tx;           // records are sealed by the kernel, write plaintext to fd
+  bool ktls_rx;           // records are opened by the kernel, read plaintext from fd
+  bool paused;            // not reading or dispatching until output drains, see rpc_client_throttle
+  usize job_bytes;        // payload bytes of requests queued for or running on handler threads
+  // Checks whether the client has gone quiet. Not moved on every read: when it fires
+  // it compares rtime to the timeout and sets itself again for the remainder if needed.
+  Timer idle;
 
+  // Request parser state. Frames before rstart have been dispatched, bytes before rpos
+  // have been parsed. racc/rlen hold the header field being decoded, rreq the fields
+  // decoded so far, so a frame split over any number of TLS records is scanned once.
   RpcClientReadState rstate;
+  bool  rtimed; // the frame being parsed has a timeout field
+  bool  rcompressed; // the frame being parsed has a compressed payload
+  // os_now_ms() when the last bytes were received. Timeouts count from here, so time a
+  // request spends buffered (behind slow inline handlers, or while paused) counts too.
+  u64   rtime;
+  usize rstart;
+  usize rpos;
+  u64   racc;
+  u8    rlen;
+  RpcRequest rreq;
+  RpcInflightTable inflight;
   Slice(u8) rbuf;
+  RpcRecvBufRef *rbuf_ref; // NULL while no handler thread holds payloads in rbuf
   Slice(u8) wbuf;
   usize wbufi;
+  struct RpcJob *streams; // jobs with stream chunks in wbuf that haven't been written out yet
+  bool  dirty; // queued in RpcWorker.dirty
+  bool  compress; // the client negotiated compression, see rpc_compression_handler
+  // Length of the last mbedtls_ssl_write call that returned WANT_WRITE.
+  // mbedtls requires the call to be repeated with exactly the same arguments.
+  usize wretry;
 } RpcClient;
-DefSlice(RpcClient);
+typedef RpcClient *RpcClientPtr;
+DefSlice(RpcClientPtr);
+
+function bool rpc_client_read(RpcClient *c);
+
+// Handler threads hand their results back to the I/O thread owning the client
+// through its completion queue, so all client state stays single-threaded.
+typedef enum RpcCompletionKind {
+  RpcCompletionKind_Response, // rsp should be sent
+  RpcCompletionKind_JobDone,  // the handler of the RpcJob this is embedded in returned
+  RpcCompletionKind_StreamChunk, // rsp is the next chunk of the stream of job
+} RpcCompletionKind;
+
+typedef struct RpcCompletion {
+  MpscNode node;
+  RpcCompletionKind kind;
+  RpcResponse rsp;
+  struct RpcJob *job;
+  bool compressed; // rsp.data went through rpc_payload_deflate
+} RpcCompletion;
+
+// Stream chunk bytes a handler thread may have outstanding (posted, but not yet written
+// to the socket) before rpc_server_stream blocks, so a stream costs bounded memory
+// however fast its handler produces and however slow its client reads.
+#define RPC_STREAM_WINDOW (256 << 10)
+
+// A queued job whose deadline passes, or that the client cancels, is answered right away
+// by the I/O thread and skipped by the handler thread that eventually pops it. Whoever
+// moves state away from Queued first decides which of the two happens.
+typedef enum RpcJobState {
+  RpcJobState_Queued,
+  RpcJobState_Running,
+  RpcJobState_Expired,
+  RpcJobState_Cancelled,
+} RpcJobState;
+
+typedef struct RpcScratch {
+  Mem_Arena arena;
+  struct RpcScratch *next;
+} RpcScratch;
+
+typedef struct RpcJob {
+  RpcCompletion  done;
+  RpcRequest     req;
+  RpcHandler     hdl;
+  RpcRecvBufRef *buf;
+  u32            state;     // RpcJobState, atomic
+  u32            cancelled; // set by the I/O thread, see rpc_request_cancelled, atomic
+  Timer          deadline;  // on the wheel of the worker of the client, if req has a deadline
+  struct RpcScratch *scratch; // from the worker of the client, given back when the job is done
+  bool           inflate;   // req.data is compressed, the handler thread decompresses it
+  bool           compress;  // the client takes compressed responses
+
+  // Streaming. The handler thread adds what it posts to stream_queued, the I/O thread
+  // takes it off again once written (or dropped) and wakes the handler if it's waiting.
+  u64            stream_queued;  // atomic
+  u32            stream_waiting; // atomic
+  Semaphore      stream_room;
+  // I/O thread only: membership of RpcClient.streams, and what this job has in wbuf.
+  struct RpcJob  *stream_next;
+  struct RpcJob **stream_pprev; // NULL while not in the list
+  usize          stream_unsent;
+  usize          stream_end;    // wbuf offset just past its last chunk
+} RpcJob;
+
+#define RPC_PORT        "4433"
+#define RPC_MAX_EVENTS  256
+#define RPC_READ_CHUNK  4096
+#define RPC_RBUF_MAX    (2 * RPC_MAX_PAYLOAD) // room for the largest frame and a read past it, a power of two
+#define RPC_PAUSED_POLL_MS 10 // how often paused clients are checked when nothing else happens
+#define RPC_KTLS_MAX_IO (1 << 30) // keeps byte counts representable as s32
+
+#define RPC_TLS_RECORD_ALERT            21
+#define RPC_TLS_RECORD_APPLICATION_DATA 23
+#define RPC_MAX_WORKERS (1 << 16)
+
+// Each worker is a shard of the server with its own thread, listening socket
+// (bound with SO_REUSEPORT, so the kernel spreads connections over the workers),
+// event loop, client table and memory base. Nothing in here is touched by other workers.
+typedef struct RpcWorker {
+  usize index;
+  struct RpcServer *server;
+  Mem_Base *mb;
+  Thread thread;
+
+  // mbedtls_ctr_drbg_context isn't thread-safe, so every worker gets its own
+  // generator and an SSL config pointing at it.
+  mbedtls_ctr_drbg_context ctr_drbg;
+  mbedtls_ssl_config       conf;
+  mbedtls_net_context      listen_fd;
+#if IsOs(OS_LINUX)
+  int epoll_fd;
+#endif
+
+  u32 client_gen;
+  Slice(RpcClientPtr) clients; // NULL entries are free slots, listed in free_slots
+  Slice(usize)        free_slots;
+  // IDs of clients with output produced during the current loop iteration.
+  // They're flushed together once all events have been handled.
+  Slice(u64)          dirty;
+  // IDs of paused clients, checked for resumption after every loop iteration.
+  Slice(u64)          paused;
+  // For requests handled on this worker's thread, cleared after each of them.
+  Mem_Arena           scratch;
+  // Idle scratch arenas for jobs on handler threads, see rpc_worker_acquire_scratch.
+  // Warm ones still have pages committed, cold ones have been trimmed.
+  struct RpcScratch  *warm_scratch;
+  usize               n_warm_scratch;
+  struct RpcScratch  *cold_scratch;
+  usize               n_cold_scratch;
+  // Ticks are os_now_ms() milliseconds. Only touched by this worker's thread.
+  TimerWheel          timers;
+  Mem_Accounting      buf_mem; // backs bufs, counted under Mem_Tag_ClientBuffers
+  RpcBufPool          bufs;
+  RpcTlsStats         tls_stats;
+  RpcReapStats        reap_stats;
+  // One per procedure in RpcServer.procs, plus one for unknown procedures.
+  RpcProcMetrics     *metrics;
+  void               *metrics_mem; // unaligned allocation backing metrics
+  usize               metrics_mem_size;
+  // Keys exported by mbedtls during the current handshake step, see rpc_client_claim_ktls_keys.
+  RpcKtlsKeys         ktls_staged;
+  bool                ktls_staged_ready;
+
+  // Filled by handler threads. The eventfd is only written when wake_pending goes
+  // from 0 to 1, so a burst of completions costs a single wakeup.
+  MpscQueue completions;
+  int       wake_fd;
+  u32       wake_pending;
+} RpcWorker;
+
+typedef struct RpcServerConfig {
+  usize n_workers;          // 0 means one per online CPU
+  usize n_handler_threads;  // 0 means handlers run on the I/O threads (streaming ones get a thread anyway)
+  usize handler_queue_size; // rounded up to a power of two
+  usize buf_pool_chunks;    // idle RPC_BUF_CHUNK buffers each worker keeps around
+  usize session_cache_size; // sessions kept for resumption by ID, 0 disables the cache
+  u32   session_timeout;    // seconds a cached session or ticket stays valid
+  bool  session_tickets;    // issue and accept RFC 5077 session tickets
+  bool  ktls;               // hand AES-GCM connections to kernel TLS after the handshake, if possible
+  // A client with more unsent output (plus payloads still with handler threads) than the
+  // high watermark isn't read from, and its buffered requests aren't dispatched, until
+  // that drops to the low watermark.
+  usize client_high_watermark; // 0 disables the per-client limit
+  usize client_low_watermark;
+  // No client is read from while all connection buffers together hold more than this.
+  usize max_buffer_memory;     // 0 disables the global limit
+  // Open connections on which nothing has been received for this long, with no request
+  // being handled, are closed. Clients keep connections alive by calling ping.
+  u32   idle_timeout_ms;       // 0 disables reaping of idle connections
+  u32   handshake_timeout_ms;  // 0 lets handshakes take as long as they like
+  const char *trace_path;      // where the trace procedure writes to, with ENABLE_TRACE
+  // Responses at least this long are compressed for clients that negotiated it. Handler
+  // threads do the compressing, so responses produced on I/O threads are sent as they are.
+  usize compress_min_size;     // 0 disables compression
+  // Every scratch arena reserves scratch_reserve bytes of address space (at least
+  // RPC_SCRATCH_MIN_RESERVE). Each worker has one of its own, and keeps up to scratch_pool
+  // idle ones for jobs on handler threads. Up to scratch_warm of those keep up to
+  // MEM_ARENA_KEEP_COMMITTED of memory committed, the others hand all of it back.
+  usize scratch_reserve;
+  usize scratch_pool;
+  usize scratch_warm;
+} RpcServerConfig;
+
+typedef struct RpcHandlerPool {
+  Thread   *threads;
+  usize     n_threads;
+  MpmcQueue queue; // of RpcJob *
+  Semaphore ready; // counts the jobs in queue
+  // n_handler_threads is 0 but streaming handlers were registered: the pool was
+  // started just for them and every other handler still runs on the I/O threads.
+  bool      streaming_only;
+} RpcHandlerPool;
 
 typedef struct RpcServer {
   Mem_Base *mb;
+  // Small objects that come and go with requests (jobs, completions), often reserved
+  // on one thread and released on another. See mem_slab_base.
+  Mem_Base *objs;
+  RpcServerConfig config;
 
   mbedtls_x509_crt          cert;
   mbedtls_pk_context        pk;
-  mbedtls_net_context       listen_fd;
-  mbedtls_ctr_drbg_context  ctr_drbg;
   mbedtls_entropy_context   entropy;
-  mbedtls_ssl_config        conf;
-  mbedtls_ssl_cache_context cache;
+  RpcSessionCache           session_cache;
+  // Shared by all workers. The ticket keys live only in memory and are rotated every
+  // session_timeout seconds, with the previous key still accepted.
+  mbedtls_ssl_ticket_context tickets;
+  mbedtls_ctr_drbg_context   tickets_drbg;
+
+  RpcWorker *workers;
+  usize      n_workers;
+  usize      buffer_memory; // bytes held by connection buffers in use, on all workers
 
-  Slice(RpcClient)  clients;
-  Slice(RpcHandler) handlers;
+  // Filled by rpc_server_reg_handler, frozen by run_rpc_server and
+  // read-only (and shared by all workers) afterwards.
+  RpcDispatchTable dispatch;
+  RpcHandlerPool   pool;
+  bool             streaming;   // some handler was registered with streaming set
+  bool             ping_inline; // procedure 0 is the built-in ping, answered by the parser itself
+  // Procedure IDs by metrics index, set up by run_rpc_server.
+  u64             *procs;
+  usize            n_procs;
+  u32              ping_metrics;
 } RpcServer;
 
-function int init_rpc_server(RpcServer *srv);
+function RpcServerConfig rpc_server_config_default(void);
+
+function int init_rpc_server(RpcServer *srv, RpcServerConfig config);
 function int run_rpc_server(RpcServer *srv);
 
+#if RPC_KTLS_AVAILABLE
+function int  rpc_ktls_export_keys(void *ctx, const unsigned char *ms, const unsigned char *kb,
+                                   size_t maclen, size_t keylen, size_t ivlen,
+                                   const unsigned char client_random[32], const unsigned char server_random[32],
+                                   mbedtls_tls_prf_types tls_prf_type);
+#endif
+function bool rpc_client_throttle(RpcClient *c);
+function void rpc_client_claim_ktls_keys(RpcClient *c);
+function void rpc_client_enable_ktls(RpcClient *c);
+function void rpc_client_drop_ktls_keys(RpcClient *c);
+
+function void rpc_worker_post(RpcWorker *w, MpscNode *n);
+function void rpc_worker_drain_completions(RpcWorker *w);
+function RpcScratch *rpc_worker_acquire_scratch(RpcWorker *w);
+function void rpc_worker_release_scratch(RpcWorker *w, RpcScratch *s);
+function void rpc_client_dispatch(RpcClient *c, RpcRequest req, RpcHandler *hdlr, bool compressed, RpcInflight *inflight);
+function void rpc_job_expire(Timer *t, void *ctx);
+function void rpc_client_idle_check(Timer *t, void *ctx);
+function void rpc_ping_handler(struct RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx);
+function void rpc_metrics_handler(struct RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx);
+function void rpc_cancel_handler(struct RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx);
+function void rpc_compression_handler(struct RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx);
+#if ENABLE_TRACE
+function void rpc_trace_handler(struct RpcServer *srv, RpcRequest req, Mem_Arena *scratch, void *ctx);
+#endif
+function void rpc_job_run(struct RpcServer *srv, RpcJob *job);
+function s32 rpc_handler_pool_init(RpcServer *srv, usize n_threads);
+function void *rpc_pool_thread(void *ctx);
+
 function RpcHandler rpc_handler_new(u64 uid, RpcHandlerFunc *f, void *ctx);
+function void       rpc_server_respond(RpcServer *srv, RpcResponse rsp);
+function void       rpc_worker_respond(RpcServer *srv, RpcResponse rsp, bool compressed);
+function void       rpc_server_respond_status(RpcServer *srv, RpcRequest *req, RpcStatus code);
+function bool       rpc_request_cancelled(RpcRequest *req);
+function bool       rpc_server_stream(RpcServer *srv, RpcRequest *req, u8 family, Slice(u8) data);
+
+// Everything the server counts is exported by rpc_server_metrics_text (the metrics procedure);
+// the rest sum up the per-worker counters it reports.
+function void            rpc_server_metrics_text(RpcServer *srv, Slice(u8) *out);
+function RpcBufPoolStats rpc_server_buf_pool_stats(RpcServer *srv);
+function RpcTlsStats     rpc_server_tls_stats(RpcServer *srv);
+function RpcReapStats    rpc_server_reap_stats(RpcServer *srv);
+function usize           rpc_server_buffer_memory(RpcServer *srv);
 function void       rpc_server_reg_handler(RpcServer *srv, RpcHandler hdl);
@@ -116,6 +116,7 @@ typedef struct Wes_ResponseField {
 typedef struct Wes_Rpc {
   String    name;
   u64       ident;
+  bool      streaming; // responds with any number of chunks of output_type.ok before the final response
   const  Wes_Type *input_type;
   const  Wes_Type *output_type;
   struct Wes_Rpc  *next;
@@ -135,6 +136,7 @@ typedef enum {
 
 typedef struct {
   Mem_Base *mb;
+  Mem_Base *nodes; // fields, types and rpcs
   String    file_contents;
   Wes_Type *types;
   Wes_Rpc  *rpcs;
@@ -144,7 +146,7 @@ typedef struct {
 function void
 wes_message_push_field(CompileState *cs, Wes_Type *t, Wes_MessageField f) {
   if (t->kind != Wes_TypeKind_Message) return;
-  Wes_MessageField *heapf = mem_reserve_commit(cs->mb, sizeof(Wes_MessageField));
+  Wes_MessageField *heapf = mem_reserve_commit(cs->nodes, sizeof(Wes_MessageField));
   *heapf = f;
   heapf->next = t->value.message;
   t->value.message = heapf;
@@ -153,7 +155,7 @@ wes_message_push_field(CompileState *cs, Wes_Type *t, Wes_MessageField f) {
 function void
 wes_response_push_field(CompileState *cs, Wes_Type *t, Wes_ResponseField f) {
   if (t->kind != Wes_TypeKind_Response) return;
-  Wes_ResponseField *heapf = mem_reserve_commit(cs->mb, sizeof(Wes_ResponseField));
+  Wes_ResponseField *heapf = mem_reserve_commit(cs->nodes, sizeof(Wes_ResponseField));
   *heapf = f;
   heapf->next = t->value.response;
   t->value.response = heapf;
@@ -161,7 +163,7 @@ wes_response_push_field(CompileState *cs, Wes_Type *t, Wes_ResponseField f) {
 
 function void
 cs_push_type(CompileState *cs, Wes_Type t) {
-  Wes_Type *heapt = mem_reserve_commit(cs->mb, sizeof(Wes_Type));
+  Wes_Type *heapt = mem_reserve_commit(cs->nodes, sizeof(Wes_Type));
   *heapt = t;
   heapt->next = cs->types;
   cs->types = heapt;
@@ -169,7 +171,7 @@ cs_push_type(CompileState *cs, Wes_Type t) {
 
 function void
 cs_push_rpc(CompileState *cs, Wes_Rpc c) {
-  Wes_Rpc *heapc = mem_reserve_commit(cs->mb, sizeof(Wes_Rpc));
+  Wes_Rpc *heapc = mem_reserve_commit(cs->nodes, sizeof(Wes_Rpc));
   *heapc = c;
   heapc->next = cs->rpcs;
   cs->rpcs = heapc;
@@ -522,10 +524,14 @@ cs_rsp(CompileState *cs) {
 
 function bool
 cs_rpc(CompileState *cs) {
-  Wes_Rpc rpc;
+  Wes_Rpc rpc = { .streaming = false };
 
   String output_type;
   if (!cs_try_ident(cs, &output_type)) return false;
+  if (StringCmp(output_type, ==, Str("stream"))) {
+    rpc.streaming = true;
+    if (!cs_try_ident(cs, &output_type)) return false;
+  }
   if (!cs_resolve_type(cs, output_type, &rpc.output_type)) return false;
   if (!cs_try_ident(cs, &rpc.name)) return false;
   cs_skip_whitespace(cs);
@@ -538,11 +544,13 @@ cs_rpc(CompileState *cs) {
   cs_skip_whitespace(cs);
   if (!cs_try_ch(cs, '@')) return false;
   if (!cs_u64_lit(cs, &rpc.ident)) return false;
+  cs_skip_whitespace(cs);
+  if (!cs_try_ch(cs, ';')) return false;
 
   s32 rpc_name_len = (s32)ClampTop(rpc.name.len, S32_MAX);
   s32 input_type_name_len = (s32)ClampTop(rpc.input_type->name.len, S32_MAX);
   s32 output_type_name_len = (s32)ClampTop(rpc.output_type->name.len, S32_MAX);
-  printf("Read an RPC: %.*s (%.*s -> %.*s)\n", rpc_name_len, rpc.name.buf, input_type_name_len, rpc.input_type->name.buf, output_type_name_len, rpc.output_type->name.buf);
+  printf("Read an RPC: %.*s (%.*s -> %s%.*s)\n", rpc_name_len, rpc.name.buf, input_type_name_len, rpc.input_type->name.buf, rpc.streaming ? "stream " : "", output_type_name_len, rpc.output_type->name.buf);
 
   cs_push_rpc(cs, rpc);
 
@@ -554,7 +562,7 @@ wes_destroy_message_fields(CompileState *cs, Wes_MessageField *fields) {
   Wes_MessageField *field = fields;
   while (field) {
     Wes_MessageField *next = field->next;
-    mem_decommit_release(cs->mb, field, sizeof(Wes_ResponseField));
+    mem_decommit_release(cs->nodes, field, sizeof(Wes_MessageField));
     field = next;
   }
 }
@@ -564,7 +572,7 @@ wes_destroy_response_fields(CompileState *cs, Wes_ResponseField *fields) {
   Wes_ResponseField *field = fields;
   while (field) {
     Wes_ResponseField *next = field->next;
-    mem_decommit_release(cs->mb, field, sizeof(Wes_ResponseField));
+    mem_decommit_release(cs->nodes, field, sizeof(Wes_ResponseField));
     field = next;
   }
 }
@@ -596,7 +604,7 @@ cs_destroy(CompileState *cs) {
   while (t) {
     Wes_Type *next = t->next;
     wes_type_destroy(cs, t);
-    mem_decommit_release(cs->mb, t, sizeof(Wes_Type));
+    mem_decommit_release(cs->nodes, t, sizeof(Wes_Type));
     t = next;
   }
 
@@ -604,7 +612,7 @@ cs_destroy(CompileState *cs) {
   while (c) {
     Wes_Rpc *next = c->next;
     wes_rpc_destroy(cs, c);
-    mem_decommit_release(cs->mb, c, sizeof(Wes_Rpc));
+    mem_decommit_release(cs->nodes, c, sizeof(Wes_Rpc));
     c = next;
   }
 }
@@ -614,10 +622,13 @@ compile_source(Mem_Base *mb, String filename, String contents) {
   s32 filename_len = (s32)ClampTop(filename.len, S32_MAX);
   printf("Compiling source file %.*s\n", filename_len, filename.buf);
 
+  Mem_Accounting nodes;
+  mem_accounting_init(&nodes, mem_slab_base(), Mem_Tag_Compiler);
   CompileState cs = {
     .file_contents = contents,
-    .i  = 0,
-    .mb = mb,
+    .i     = 0,
+    .mb    = mb,
+    .nodes = &nodes.base,
   };
 
   while (true) {
@@ -669,7 +680,9 @@ process_file(Mem_Base *mb, String filename) {
 s32
 main(s32 argc, char *argv[]) {
   wes_init_primitive_types();
-  Mem_Base *mb = mem_malloc_base();
+  Mem_Accounting mem;
+  mem_accounting_init(&mem, mem_malloc_base(), Mem_Tag_Compiler);
+  Mem_Base *mb = &mem.base;
 
   if (argc == 1) {
     fputs("Error: no files to compile provided\n", stderr);